@@ -0,0 +1,43 @@
+#ifndef _SLACK_DEBUG_MACROS_H_
+#define _SLACK_DEBUG_MACROS_H_
+
+#include <debug.h>
+
+/* Debug messages below this level are compiled out entirely (e.g., make LOCAL_CFLAGS=-DSLACK_DEBUG_MIN_LEVEL=PURPLE_DEBUG_INFO) */
+#ifndef SLACK_DEBUG_MIN_LEVEL
+#define SLACK_DEBUG_MIN_LEVEL PURPLE_DEBUG_ALL
+#endif
+
+/* Longest payload (message body) to log, unless verbose debugging is on */
+#ifndef SLACK_DEBUG_PAYLOAD_MAX
+#define SLACK_DEBUG_PAYLOAD_MAX 1024
+#endif
+
+/* Would purple_debug actually output anything?  Same test libpurple does, but before we build the arguments. */
+static inline gboolean slack_debug_wanted(PurpleDebugLevel level, const char *category) {
+	if (level < SLACK_DEBUG_MIN_LEVEL)
+		return FALSE;
+	if (purple_debug_is_enabled())
+		return TRUE;
+	PurpleDebugUiOps *ops = purple_debug_get_ui_ops();
+	return ops && ops->print && (!ops->is_enabled || ops->is_enabled(level, category));
+}
+
+/* Like purple_debug, but arguments are not evaluated (and nothing is formatted) unless the message will be output */
+#define SLACK_DEBUG(LEVEL, CATEGORY, FORMAT...) ({ \
+		if (slack_debug_wanted(LEVEL, CATEGORY)) \
+			purple_debug(LEVEL, CATEGORY, FORMAT); \
+	})
+#define DEBUG_MISC(CATEGORY, FORMAT...)		SLACK_DEBUG(PURPLE_DEBUG_MISC, CATEGORY, FORMAT)
+#define DEBUG_INFO(CATEGORY, FORMAT...)		SLACK_DEBUG(PURPLE_DEBUG_INFO, CATEGORY, FORMAT)
+#define DEBUG_WARNING(CATEGORY, FORMAT...)	SLACK_DEBUG(PURPLE_DEBUG_WARNING, CATEGORY, FORMAT)
+#define DEBUG_ERROR(CATEGORY, FORMAT...)	SLACK_DEBUG(PURPLE_DEBUG_ERROR, CATEGORY, FORMAT)
+
+/* How much of a len-byte payload to log with "%.*s" */
+static inline int slack_debug_payload_len(size_t len) {
+	if (len > SLACK_DEBUG_PAYLOAD_MAX && !purple_debug_is_verbose())
+		return SLACK_DEBUG_PAYLOAD_MAX;
+	return len;
+}
+
+#endif
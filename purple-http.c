@@ -0,0 +1,653 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+#include <core.h>
+#include <sslconn.h>
+#include <util.h>
+
+#include "purple-debug.h"
+#include "purple-http.h"
+
+/* idle connections are closed after this many seconds */
+#define HTTP_IDLE_TIMEOUT 30
+/* non-idempotent requests, which can't be retried, only reuse connections idle for less than this many seconds */
+#define HTTP_FRESH_IDLE 2
+#define HTTP_MAX_HEADERS 16384
+#define HTTP_READ_SIZE 16384
+
+typedef struct _PurpleHttpConn PurpleHttpConn;
+
+struct _PurpleHttpPool {
+	PurpleAccount *account;
+	unsigned max_conns, max_pipeline;
+
+	GList *conns; /* PurpleHttpConn */
+	GQueue queue; /* PurpleHttpRequest not yet sent */
+	guint dispatch_timer;
+
+	unsigned long connections, requests;
+};
+
+struct _PurpleHttpRequest {
+	PurpleHttpPool *pool;
+	PurpleHttpConn *conn; /* once sent */
+	char *host;
+	int port;
+	gboolean ssl;
+	GString *request;
+	gsize max_len;
+	gboolean idempotent; /* may be pipelined and retried */
+	PurpleHttpCallback callback; /* NULL once cancelled (or called) */
+	gpointer data;
+	gboolean retried;
+
+	/* response */
+	int status;
+	char *headers;
+};
+
+struct _PurpleHttpConn {
+	PurpleHttpPool *pool;
+	char *host;
+	int port;
+	gboolean ssl;
+
+	PurpleProxyConnectData *connection;
+	PurpleSslConnection *ssl_connection;
+	int fd;
+	guint inpa;
+	guint idle_timer;
+	gint64 idle_since; /* monotonic time the last response finished */
+	gboolean connected;
+	gboolean closing; /* server said Connection: close */
+
+	GString *output;
+	gsize output_off;
+	GString *input;
+	GQueue sent; /* PurpleHttpRequest awaiting responses, in order */
+	unsigned long served;
+
+	/* response in progress (input starts after its headers) */
+	gboolean in_body;
+	gssize content_length; /* -1 if not given */
+	gboolean chunked;
+	gsize chunk_off; /* next chunk size line in input */
+	GString *body; /* decoded chunks */
+};
+
+static void http_dispatch(PurpleHttpPool *pool);
+
+static void http_request_free(PurpleHttpRequest *req) {
+	g_free(req->host);
+	g_string_free(req->request, TRUE);
+	g_free(req->headers);
+	g_free(req);
+}
+
+/* tear down the connection, dropping any requests without calling them back */
+static void http_conn_free(PurpleHttpConn *conn) {
+	conn->pool->conns = g_list_remove(conn->pool->conns, conn);
+
+	if (conn->ssl_connection)
+		purple_ssl_close(conn->ssl_connection);
+	else if (conn->fd >= 0)
+		close(conn->fd);
+	if (conn->connection)
+		purple_proxy_connect_cancel(conn->connection);
+	if (conn->inpa)
+		purple_input_remove(conn->inpa);
+	if (conn->idle_timer)
+		purple_timeout_remove(conn->idle_timer);
+
+	PurpleHttpRequest *req;
+	while ((req = g_queue_pop_head(&conn->sent)))
+		http_request_free(req);
+
+	g_free(conn->host);
+	g_string_free(conn->output, TRUE);
+	g_string_free(conn->input, TRUE);
+	g_string_free(conn->body, TRUE);
+	g_free(conn);
+}
+
+/* Close the connection: idempotent requests that were never answered on a reused connection are tried again elsewhere, the rest fail */
+static void http_conn_close(PurpleHttpConn *conn, const char *error) {
+	PurpleHttpPool *pool = conn->pool;
+	GQueue sent = conn->sent;
+	gboolean started = conn->in_body || conn->input->len;
+
+	DEBUG_MISC("http", "closing connection to %s:%d after %lu responses: %s\n", conn->host, conn->port, conn->served, error ?: "idle");
+	g_queue_init(&conn->sent);
+	gboolean reused = conn->served > 0;
+	http_conn_free(conn);
+
+	PurpleHttpRequest *req;
+	GList *retry = NULL;
+	gboolean first = TRUE;
+	while ((req = g_queue_pop_head(&sent))) {
+		req->conn = NULL;
+		if (req->callback && req->idempotent && reused && !req->retried && !(first && started)) {
+			req->retried = TRUE;
+			retry = g_list_prepend(retry, req);
+		} else if (req->callback) {
+			PurpleHttpCallback callback = req->callback;
+			req->callback = NULL;
+			callback(req, req->data, NULL, 0, error ?: "Connection closed");
+			http_request_free(req);
+		} else
+			http_request_free(req);
+		first = FALSE;
+	}
+
+	/* back to the front of the queue, in their original order */
+	GList *l;
+	for (l = retry; l; l = l->next)
+		g_queue_push_head(&pool->queue, l->data);
+	g_list_free(retry);
+
+	http_dispatch(pool);
+}
+
+static gboolean http_idle_cb(gpointer data) {
+	PurpleHttpConn *conn = data;
+	conn->idle_timer = 0;
+	http_conn_close(conn, NULL);
+	return FALSE;
+}
+
+static void http_input_cb(gpointer data, gint source, PurpleInputCondition cond);
+
+static void http_watch(PurpleHttpConn *conn) {
+	if (conn->inpa) {
+		purple_input_remove(conn->inpa);
+		conn->inpa = 0;
+	}
+
+	PurpleInputCondition cond = (conn->ssl_connection ? 0 : PURPLE_INPUT_READ); /* permanent purple_ssl_input_add for ssl */
+	if (conn->output_off < conn->output->len)
+		cond |= PURPLE_INPUT_WRITE;
+
+	if (cond)
+		conn->inpa = purple_input_add(conn->fd, cond, http_input_cb, conn);
+}
+
+/* Pass the finished response for the first request on, and drop consumed bytes of input; returns FALSE if the connection is gone */
+static gboolean http_deliver(PurpleHttpConn *conn, const gchar *body, gsize len, gsize consumed) {
+	PurpleHttpRequest *req = g_queue_pop_head(&conn->sent);
+	req->conn = NULL;
+	conn->served++;
+	conn->pool->requests++;
+
+	if (req->callback) {
+		PurpleHttpCallback callback = req->callback;
+		req->callback = NULL;
+		callback(req, req->data, body, len, NULL);
+	}
+	http_request_free(req);
+
+	g_string_erase(conn->input, 0, consumed);
+	g_string_truncate(conn->body, 0);
+	conn->in_body = FALSE;
+	conn->chunked = FALSE;
+	conn->content_length = -1;
+	conn->chunk_off = 0;
+
+	if (conn->closing) {
+		http_conn_close(conn, "Connection closed by server");
+		return FALSE;
+	}
+
+	if (g_queue_is_empty(&conn->sent)) {
+		conn->idle_since = g_get_monotonic_time();
+		conn->idle_timer = purple_timeout_add_seconds(HTTP_IDLE_TIMEOUT, http_idle_cb, conn);
+	}
+	/* a pipeline slot is free */
+	http_dispatch(conn->pool);
+	return TRUE;
+}
+
+static gboolean http_read_headers(PurpleHttpConn *conn, PurpleHttpRequest *req) {
+	char *eoh = g_strstr_len(conn->input->str, conn->input->len, "\r\n\r\n");
+	if (!eoh) {
+		if (conn->input->len > HTTP_MAX_HEADERS) {
+			http_conn_close(conn, "HTTP response headers too long");
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	g_free(req->headers);
+	req->headers = g_strndup(conn->input->str, eoh + 2 - conn->input->str);
+	g_string_erase(conn->input, 0, eoh + 4 - conn->input->str);
+
+	int minor;
+	if (sscanf(req->headers, "HTTP/1.%d %d", &minor, &req->status) != 2) {
+		http_conn_close(conn, "Invalid HTTP response");
+		return FALSE;
+	}
+	if (req->status / 100 == 1)
+		/* interim response: the real one follows */
+		return TRUE;
+
+	gchar *v;
+	conn->content_length = -1;
+	if ((v = purple_http_request_get_header(req, "Content-Length"))) {
+		conn->content_length = g_ascii_strtoull(v, NULL, 10);
+		g_free(v);
+	}
+	if ((v = purple_http_request_get_header(req, "Transfer-Encoding"))) {
+		conn->chunked = !g_ascii_strcasecmp(v, "chunked");
+		g_free(v);
+	}
+	if ((v = purple_http_request_get_header(req, "Connection"))) {
+		if (!g_ascii_strcasecmp(v, "close"))
+			conn->closing = TRUE;
+		g_free(v);
+	} else if (minor == 0)
+		conn->closing = TRUE;
+	if (req->status == 204 || req->status == 304)
+		conn->content_length = 0;
+
+	if (conn->content_length > (gssize)req->max_len) {
+		http_conn_close(conn, "HTTP response too large");
+		return FALSE;
+	}
+	conn->in_body = TRUE;
+	return TRUE;
+}
+
+/* Decode complete chunks into body: returns the input length of the whole response once it's done, 0 if more is needed, or -1 if the connection is gone */
+static gssize http_read_chunks(PurpleHttpConn *conn, PurpleHttpRequest *req) {
+	GString *in = conn->input;
+	for (;;) {
+		char *line = in->str + conn->chunk_off;
+		char *eol = g_strstr_len(line, in->len - conn->chunk_off, "\r\n");
+		if (!eol)
+			break;
+		gsize size = g_ascii_strtoull(line, NULL, 16);
+		gsize data = eol + 2 - in->str;
+		if (!size) {
+			/* last chunk: skip any trailers, up to an empty line */
+			if (in->len - data >= 2 && !memcmp(in->str + data, "\r\n", 2))
+				return data + 2;
+			char *end = g_strstr_len(in->str + data, in->len - data, "\r\n\r\n");
+			if (end)
+				return end + 4 - in->str;
+			break;
+		}
+		if (in->len < data + size + 2)
+			break;
+		g_string_append_len(conn->body, in->str + data, size);
+		if (conn->body->len > req->max_len) {
+			http_conn_close(conn, "HTTP response too large");
+			return -1;
+		}
+		conn->chunk_off = data + size + 2;
+	}
+
+	/* drop the chunks already decoded */
+	g_string_erase(in, 0, conn->chunk_off);
+	conn->chunk_off = 0;
+	return 0;
+}
+
+/* Handle whatever complete responses are in input; returns FALSE if the connection is gone */
+static gboolean http_read(PurpleHttpConn *conn) {
+	while (conn->input->len || conn->in_body) {
+		PurpleHttpRequest *req = g_queue_peek_head(&conn->sent);
+		if (!req) {
+			http_conn_close(conn, "Unexpected HTTP response");
+			return FALSE;
+		}
+
+		if (!conn->in_body) {
+			gsize len = conn->input->len;
+			if (!http_read_headers(conn, req))
+				return FALSE;
+			if (conn->input->len == len)
+				/* need more */
+				return TRUE;
+			continue;
+		}
+
+		if (conn->chunked) {
+			gssize end = http_read_chunks(conn, req);
+			if (end <= 0)
+				return end == 0;
+			if (!http_deliver(conn, conn->body->str, conn->body->len, end))
+				return FALSE;
+			continue;
+		}
+
+		if (conn->content_length < 0 && conn->input->len > req->max_len) {
+			http_conn_close(conn, "HTTP response too large");
+			return FALSE;
+		}
+		if (conn->content_length < 0 || conn->input->len < (gsize)conn->content_length)
+			/* need more (or everything until the connection closes) */
+			return TRUE;
+		if (!http_deliver(conn, conn->input->str, conn->content_length, conn->content_length))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void http_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCondition cond) {
+	PurpleHttpConn *conn = data;
+
+	if (cond & PURPLE_INPUT_WRITE) {
+		ssize_t len = conn->ssl_connection
+			? (ssize_t)purple_ssl_write(conn->ssl_connection, conn->output->str + conn->output_off, conn->output->len - conn->output_off)
+			: write(conn->fd, conn->output->str + conn->output_off, conn->output->len - conn->output_off);
+
+		if (len < 0) {
+			if (errno != EAGAIN) {
+				http_conn_close(conn, g_strerror(errno));
+				return;
+			}
+		} else if ((conn->output_off += len) >= conn->output->len) {
+			g_string_truncate(conn->output, 0);
+			conn->output_off = 0;
+			http_watch(conn);
+		}
+	}
+
+	while (cond & PURPLE_INPUT_READ) {
+		gsize off = conn->input->len;
+		g_string_set_size(conn->input, off + HTTP_READ_SIZE);
+		ssize_t len = conn->ssl_connection
+			? (ssize_t)purple_ssl_read(conn->ssl_connection, conn->input->str + off, HTTP_READ_SIZE)
+			: read(conn->fd, conn->input->str + off, HTTP_READ_SIZE);
+		g_string_set_size(conn->input, off + MAX(len, 0));
+
+		if (len < 0) {
+			if (errno != EAGAIN) {
+				http_conn_close(conn, g_strerror(errno));
+				return;
+			}
+			cond &= ~PURPLE_INPUT_READ;
+		}
+		else if (len == 0) {
+			/* a response without a length ends here */
+			if (conn->in_body && !conn->chunked && conn->content_length < 0) {
+				conn->closing = TRUE;
+				http_deliver(conn, conn->input->str, conn->input->len, conn->input->len);
+			} else
+				http_conn_close(conn, "Connection closed");
+			return;
+		}
+		else if (!http_read(conn))
+			return;
+	}
+}
+
+static void https_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleInputCondition cond) {
+	PurpleHttpConn *conn = data;
+	http_input_cb(data, conn->fd, cond);
+}
+
+static void http_connected(PurpleHttpConn *conn) {
+	conn->connected = TRUE;
+	if (conn->ssl_connection)
+		purple_ssl_input_add(conn->ssl_connection, https_input_cb, conn);
+	http_watch(conn);
+}
+
+static void https_connect_cb(gpointer data, PurpleSslConnection *ssl_connection, G_GNUC_UNUSED PurpleInputCondition cond) {
+	PurpleHttpConn *conn = data;
+	conn->fd = ssl_connection->fd;
+	http_connected(conn);
+}
+
+static void https_error_cb(G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleSslErrorType error, gpointer data) {
+	PurpleHttpConn *conn = data;
+	conn->ssl_connection = NULL;
+	http_conn_close(conn, purple_ssl_strerror(error));
+}
+
+static void http_connect_cb(gpointer data, gint source, const gchar *error_message) {
+	PurpleHttpConn *conn = data;
+	conn->connection = NULL;
+
+	if (source == -1) {
+		http_conn_close(conn, error_message ?: "Unable to connect");
+		return;
+	}
+
+	conn->fd = source;
+	http_connected(conn);
+}
+
+static PurpleHttpConn *http_conn_new(PurpleHttpPool *pool, PurpleHttpRequest *req) {
+	PurpleHttpConn *conn = g_new0(PurpleHttpConn, 1);
+	conn->pool = pool;
+	conn->host = g_strdup(req->host);
+	conn->port = req->port;
+	conn->ssl = req->ssl;
+	conn->fd = -1;
+	conn->output = g_string_new(NULL);
+	conn->input = g_string_new(NULL);
+	conn->body = g_string_new(NULL);
+	conn->content_length = -1;
+
+	if (conn->ssl)
+		conn->ssl_connection = purple_ssl_connect(pool->account, conn->host, conn->port,
+				https_connect_cb, https_error_cb, conn);
+	else
+		conn->connection = purple_proxy_connect(NULL, pool->account, conn->host, conn->port,
+				http_connect_cb, conn);
+
+	if (!(conn->ssl_connection || conn->connection)) {
+		http_conn_free(conn);
+		return NULL;
+	}
+
+	pool->conns = g_list_prepend(pool->conns, conn);
+	pool->connections++;
+	DEBUG_MISC("http", "connecting to %s:%d (%u open)\n", conn->host, conn->port, g_list_length(pool->conns));
+	return conn;
+}
+
+/* Whether only idempotent requests are outstanding on conn (others go alone, so it's enough to look at the first) */
+static gboolean http_conn_pipelining(PurpleHttpConn *conn) {
+	PurpleHttpRequest *req = g_queue_peek_head(&conn->sent);
+	return !req || req->idempotent;
+}
+
+static void http_send(PurpleHttpConn *conn, PurpleHttpRequest *req) {
+	req->conn = conn;
+	g_queue_push_tail(&conn->sent, req);
+	g_string_append_len(conn->output, req->request->str, req->request->len);
+
+	if (conn->idle_timer) {
+		purple_timeout_remove(conn->idle_timer);
+		conn->idle_timer = 0;
+	}
+	if (conn->connected)
+		http_watch(conn);
+}
+
+static gboolean http_same_host(const PurpleHttpRequest *a, const char *host, int port, gboolean ssl) {
+	return a->port == port && a->ssl == ssl && !g_ascii_strcasecmp(a->host, host);
+}
+
+static gint http_request_host_cmp(gconstpointer a, gconstpointer b) {
+	const PurpleHttpRequest *rb = b;
+	return !http_same_host(a, rb->host, rb->port, rb->ssl);
+}
+
+/* Where to send req: an idle connection, else a new one (NULL with *open set), else the shortest pipeline (only for idempotent requests);
+ * or NULL if it has to wait */
+static PurpleHttpConn *http_conn_pick(PurpleHttpPool *pool, PurpleHttpRequest *req, gboolean *open) {
+	PurpleHttpConn *best = NULL;
+	unsigned count = 0;
+	gint64 stale = g_get_monotonic_time() - HTTP_FRESH_IDLE * G_USEC_PER_SEC;
+	GList *l, *next;
+	for (l = pool->conns; l; l = next) {
+		PurpleHttpConn *conn = l->data;
+		next = l->next;
+		if (!http_same_host(req, conn->host, conn->port, conn->ssl))
+			continue;
+		if (!req->idempotent && conn->served && !conn->sent.length && conn->idle_since < stale) {
+			/* the server may have closed it already, and this request couldn't be retried: make room for a new one */
+			DEBUG_MISC("http", "closing connection to %s:%d idle too long to reuse\n", conn->host, conn->port);
+			http_conn_free(conn);
+			continue;
+		}
+		count++;
+		if (conn->closing || (conn->sent.length && !(req->idempotent && http_conn_pipelining(conn))))
+			continue;
+		if (!best || conn->sent.length < best->sent.length)
+			best = conn;
+	}
+
+	*open = FALSE;
+	if (best && !best->sent.length)
+		return best;
+	if (count < pool->max_conns)
+		*open = TRUE;
+	else if (best && best->sent.length < pool->max_pipeline)
+		return best;
+	return NULL;
+}
+
+/* Hand queued requests to connections, in order, except that those for a host with no room don't hold up other hosts */
+static void http_dispatch(PurpleHttpPool *pool) {
+	GSList *blocked = NULL; /* a waiting request for each host that can't take any more */
+	GList *l = pool->queue.head;
+	while (l) {
+		GList *next = l->next;
+		PurpleHttpRequest *req = l->data;
+		gboolean open = FALSE;
+		PurpleHttpConn *conn = NULL;
+		if (!g_slist_find_custom(blocked, req, http_request_host_cmp)) {
+			conn = http_conn_pick(pool, req, &open);
+			if (!conn && !open)
+				blocked = g_slist_prepend(blocked, req);
+		}
+		if (!conn && !open) {
+			l = next;
+			continue;
+		}
+
+		g_queue_delete_link(&pool->queue, l);
+		if (!conn && !(conn = http_conn_new(pool, req))) {
+			PurpleHttpCallback callback = req->callback;
+			req->callback = NULL;
+			callback(req, req->data, NULL, 0, "Unable to connect");
+			http_request_free(req);
+			/* which may have changed the queue: start over */
+			g_slist_free(blocked);
+			blocked = NULL;
+			l = pool->queue.head;
+			continue;
+		}
+
+		http_send(conn, req);
+		l = next;
+	}
+	g_slist_free(blocked);
+}
+
+static gboolean http_dispatch_cb(gpointer data) {
+	PurpleHttpPool *pool = data;
+	pool->dispatch_timer = 0;
+	http_dispatch(pool);
+	return FALSE;
+}
+
+PurpleHttpPool *purple_http_pool_new(PurpleAccount *account, unsigned max_conns, unsigned max_pipeline) {
+	PurpleHttpPool *pool = g_new0(PurpleHttpPool, 1);
+	pool->account = account;
+	pool->max_conns = MAX(max_conns, 1);
+	pool->max_pipeline = MAX(max_pipeline, 1);
+	g_queue_init(&pool->queue);
+	return pool;
+}
+
+void purple_http_pool_free(PurpleHttpPool *pool) {
+	while (pool->conns)
+		http_conn_free(pool->conns->data);
+
+	PurpleHttpRequest *req;
+	while ((req = g_queue_pop_head(&pool->queue)))
+		http_request_free(req);
+
+	if (pool->dispatch_timer)
+		purple_timeout_remove(pool->dispatch_timer);
+	g_free(pool);
+}
+
+void purple_http_pool_get_counts(PurpleHttpPool *pool, unsigned long *connections, unsigned long *requests) {
+	*connections = pool->connections;
+	*requests = pool->requests;
+}
+
+PurpleHttpRequest *purple_http_request(PurpleHttpPool *pool, const char *url, gsize max_len, gboolean idempotent, PurpleHttpCallback callback, gpointer user_data) {
+	g_return_val_if_fail(callback, NULL);
+
+	gboolean ssl = !g_ascii_strncasecmp(url, "https://", 8);
+	char *host, *path;
+	int port;
+	if (!purple_url_parse(url, &host, &port, &path, NULL, NULL))
+		return NULL;
+
+	PurpleHttpRequest *req = g_new0(PurpleHttpRequest, 1);
+	req->pool = pool;
+	req->host = host;
+	req->port = port;
+	req->ssl = ssl;
+	req->max_len = max_len;
+	req->idempotent = idempotent;
+	req->callback = callback;
+	req->data = user_data;
+
+	req->request = g_string_new(NULL);
+	g_string_printf(req->request, "GET /%s HTTP/1.1\r\nUser-Agent: libpurple/%s\r\n", path, purple_core_get_version());
+	if (port == (ssl ? 443 : 80))
+		g_string_append_printf(req->request, "Host: %s\r\n\r\n", host);
+	else
+		g_string_append_printf(req->request, "Host: %s:%d\r\n\r\n", host, port);
+	g_free(path);
+
+	/* requests made together get dispatched together (and never call back before we return) */
+	g_queue_push_tail(&pool->queue, req);
+	if (!pool->dispatch_timer)
+		pool->dispatch_timer = purple_timeout_add(0, http_dispatch_cb, pool);
+	return req;
+}
+
+void purple_http_request_cancel(PurpleHttpRequest *req) {
+	if (!req->conn && req->callback) {
+		/* still queued */
+		g_queue_remove(&req->pool->queue, req);
+		http_request_free(req);
+	} else
+		/* already sent (or in its callback): the response is discarded */
+		req->callback = NULL;
+}
+
+int purple_http_request_get_status(PurpleHttpRequest *req) {
+	return req->status;
+}
+
+gchar *purple_http_request_get_header(PurpleHttpRequest *req, const char *name) {
+	int nlen = strlen(name);
+	const char *p = req->headers;
+
+	while (p && (p = strstr(p, "\r\n"))) {
+		p += 2;
+		if (!g_ascii_strncasecmp(p, name, nlen) && p[nlen] == ':') {
+			p += nlen+1;
+			const char *e = strstr(p, "\r\n");
+			return g_strstrip(g_strndup(p, e ? e - p : (gssize)strlen(p)));
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef _PURPLE_HTTP_H_
+#define _PURPLE_HTTP_H_
+
+#include <glib.h>
+
+/* A small HTTP/1.1 client that keeps connections alive and pipelines requests over them */
+typedef struct _PurpleHttpPool PurpleHttpPool;
+typedef struct _PurpleHttpRequest PurpleHttpRequest;
+
+/* Called once per request (unless cancelled), with the response body or an error */
+typedef void (*PurpleHttpCallback)(PurpleHttpRequest *req, gpointer user_data, const gchar *body, gsize len, const gchar *error);
+
+/* Use up to max_conns connections per host, each with up to max_pipeline requests outstanding */
+PurpleHttpPool *purple_http_pool_new(PurpleAccount *account, unsigned max_conns, unsigned max_pipeline);
+/* Close all connections and drop all requests (without calling their callbacks) */
+void purple_http_pool_free(PurpleHttpPool *pool);
+/* Connections opened and responses received so far */
+void purple_http_pool_get_counts(PurpleHttpPool *pool, unsigned long *connections, unsigned long *requests);
+
+/* GET url, accepting a body of at most max_len bytes.
+ * Only idempotent requests are pipelined, or sent again when a reused connection drops before answering;
+ * others are sent alone on a new or idle connection, and fail if it drops. */
+PurpleHttpRequest *purple_http_request(PurpleHttpPool *pool, const char *url, gsize max_len, gboolean idempotent, PurpleHttpCallback callback, gpointer user_data);
+/* The callback will not be called (req is invalid after this) */
+void purple_http_request_cancel(PurpleHttpRequest *req);
+
+/* Response status and headers, only valid during the callback */
+int purple_http_request_get_status(PurpleHttpRequest *req);
+/* Newly allocated value of the named header, or NULL */
+gchar *purple_http_request_get_header(PurpleHttpRequest *req, const char *name);
+
+#endif
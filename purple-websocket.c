@@ -2,15 +2,20 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <cipher.h>
-#include <debug.h>
 #include <sslconn.h>
 
+#include "purple-debug.h"
 #include "purple-websocket.h"
 
 static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -19,6 +24,7 @@ static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 #define WS_RSV2 0x20
 #define WS_RSV3 0x10
 #define WS_OP_MASK 0x0F
+#define WS_OP_CTRL 0x08 /* control frames have this set */
 #define WS_OP_CONT 0x00
 #define WS_OP_TEXT 0x01
 #define WS_OP_BIN  0x02
@@ -28,8 +34,17 @@ static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 #define WS_MASK	0x80
 #define MAX_FRAG 64
 
+/* receive buffer size (beyond what single frames need) adapts between these */
+#define INPUT_MIN 4096
+#define INPUT_MAX_DEFAULT (256*1024)
+
+/* permessage-deflate: smaller messages are sent uncompressed, larger inflated messages are rejected */
+#define DEFLATE_MIN 64
+#define INFLATE_MAX (64*1024*1024)
+
 struct buffer {
 	guchar *buf;
+	gsize pos; /* start of unconsumed data (input only) */
 	gsize off; /* next byte to read/write to */
 	gsize len; /* (expected) size of data in buffer */
 	gsize siz; /* allocated size of buffer */
@@ -48,6 +63,17 @@ struct _PurpleWebsocket {
 	guint inpa;
 
 	struct buffer input, output;
+	gsize input_max; /* ceiling for growing input.siz on full reads */
+	gsize input_peak; /* largest read since the last idle */
+	unsigned input_full; /* consecutive reads that filled the buffer */
+
+	unsigned long reads, messages;
+
+	/* permessage-deflate (RFC 7692), if the server accepted it */
+	gboolean deflate;
+	gboolean inflate_reset, deflate_reset; /* no_context_takeover */
+	z_stream inflate_z, deflate_z;
+	struct buffer inflated, deflated;
 
 	gboolean connected;
 	PurpleInputCondition closed;
@@ -61,9 +87,42 @@ static void buffer_set_len(struct buffer *b, size_t n) {
 	b->len = n;
 }
 
+/* ask for n bytes of data starting at pos, only compacting the buffer when they don't fit */
+static void buffer_need(struct buffer *b, size_t n) {
+	if (b->pos + n > b->siz && b->pos) {
+		memmove(b->buf, b->buf + b->pos, b->off -= b->pos);
+		b->pos = 0;
+	}
+	buffer_set_len(b, b->pos + n);
+}
+
+/* change the allocated size, keeping at least the pending data */
+static void buffer_resize(struct buffer *b, size_t n) {
+	if (b->pos) {
+		memmove(b->buf, b->buf + b->pos, b->off -= b->pos);
+		b->len -= b->pos;
+		b->pos = 0;
+	}
+	if (n < b->len)
+		n = b->len;
+	if (n != b->siz) {
+		b->buf = g_realloc(b->buf, n);
+		b->siz = n;
+	}
+}
+
+/* n bytes at pos have been handled */
+static void buffer_consume(struct buffer *b, size_t n) {
+	if ((b->pos += n) == b->off)
+		b->pos = b->off = 0;
+}
+
+/* append n bytes, growing geometrically so the (output) buffer settles at its working size */
 static inline guchar *buffer_incr(struct buffer *b, size_t n) {
 	gsize l = b->len;
-	buffer_set_len(b, l + n);
+	if (l + n > b->siz)
+		buffer_set_len(b, MAX(l + n, 2*b->siz));
+	b->len = l + n;
 	return &b->buf[l];
 }
 
@@ -74,16 +133,23 @@ void purple_websocket_abort(PurpleWebsocket *ws) {
 	if (ws->connection != NULL)
 		purple_proxy_connect_cancel(ws->connection);
 
-	purple_debug_misc("websocket", "removing input %d\n", ws->inpa);
+	DEBUG_MISC("websocket", "removing input %d\n", ws->inpa);
 	if (ws->inpa > 0)
 		purple_input_remove(ws->inpa);
 
 	if (ws->fd >= 0)
 		close(ws->fd);
 
+	if (ws->deflate) {
+		inflateEnd(&ws->inflate_z);
+		deflateEnd(&ws->deflate_z);
+	}
+
 	g_free(ws->key);
 	g_free(ws->output.buf);
 	g_free(ws->input.buf);
+	g_free(ws->inflated.buf);
+	g_free(ws->deflated.buf);
 
 	g_free(ws);
 }
@@ -127,6 +193,39 @@ static const char *find_header_content(const char *data, const char *name) {
 	return NULL;
 }
 
+/* accept the server's permessage-deflate parameters (we offer no options, so only these are possible) */
+static gboolean ws_read_extensions(PurpleWebsocket *ws, const char *ext) {
+	const char *e = strstr(ext, "\r\n");
+	gchar *val = e ? g_strndup(ext, e - ext) : g_strdup(ext);
+	gchar **params = g_strsplit(val, ";", 0);
+	g_free(val);
+
+	gboolean ok = !g_strcmp0(g_strstrip(params[0]), "permessage-deflate");
+	unsigned i;
+	for (i = 1; ok && params[i]; i++) {
+		const char *p = g_strstrip(params[i]);
+		if (!strcmp(p, "server_no_context_takeover"))
+			ws->inflate_reset = TRUE;
+		else if (!strcmp(p, "client_no_context_takeover"))
+			ws->deflate_reset = TRUE;
+		else if (strncmp(p, "server_max_window_bits", 22) || !strchr("=;, \t", p[22] /* or NUL */))
+			/* a smaller server window is fine: we always inflate with the largest */
+			ok = FALSE;
+	}
+	g_strfreev(params);
+	if (!ok)
+		return FALSE;
+
+	if (inflateInit2(&ws->inflate_z, -MAX_WBITS) != Z_OK)
+		return FALSE;
+	if (deflateInit2(&ws->deflate_z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		inflateEnd(&ws->inflate_z);
+		return FALSE;
+	}
+	ws->deflate = TRUE;
+	return TRUE;
+}
+
 static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 	const char *upgrade = skip_lws(find_header_content(headers, "Upgrade"));
 	if (upgrade && (g_ascii_strncasecmp(upgrade, "websocket", 9) || skip_lws(upgrade+9)))
@@ -155,21 +254,69 @@ static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 		g_free(b);
 	}
 
-	/* TODO: Sec-WebSocket-Extensions, Sec-WebSocket-Protocol */
+	/* TODO: Sec-WebSocket-Protocol */
 
 	if (strncmp(headers, "HTTP/1.1 101 ", 13) || !upgrade || !connection || !accept) {
 		ws_error(ws, headers);
 		return FALSE;
 	}
 
+	/* no extensions header means no compression */
+	const char *extensions = skip_lws(find_header_content(headers, "Sec-WebSocket-Extensions"));
+	if (extensions && !ws_read_extensions(ws, extensions)) {
+		ws_error(ws, "Unsupported websocket extension");
+		return FALSE;
+	}
+
 	ws->connected = TRUE;
 	ws->callback(ws, ws->user_data, PURPLE_WEBSOCKET_OPEN, NULL, 0);
 	return TRUE;
 }
 
+/* decompress a message into ws->inflated, replacing msg/len */
+static gboolean ws_inflate(PurpleWebsocket *ws, guchar **msg, size_t *len) {
+	static const guchar tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	z_stream *z = &ws->inflate_z;
+	struct buffer *b = &ws->inflated;
+	int r = Z_OK;
+	unsigned pass;
+
+	b->off = 0;
+	for (pass = 0; pass < 2 && r != Z_STREAM_END; pass++) {
+		z->next_in = pass ? (Bytef *)tail : *msg;
+		z->avail_in = pass ? sizeof(tail) : *len;
+		do {
+			if (b->off == b->siz) {
+				if (b->siz >= INFLATE_MAX) {
+					ws_error(ws, "Decompressed message too large");
+					return FALSE;
+				}
+				buffer_set_len(b, MAX(2*b->siz, 4096));
+			}
+			z->next_out = b->buf + b->off;
+			z->avail_out = b->siz - b->off;
+			r = inflate(z, Z_SYNC_FLUSH);
+			b->off = z->next_out - b->buf;
+		} while (r == Z_OK && (z->avail_in || !z->avail_out));
+
+		if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+			ws_error(ws, z->msg ?: "Invalid compressed message");
+			return FALSE;
+		}
+	}
+
+	if (r == Z_STREAM_END || ws->inflate_reset)
+		inflateReset(z);
+
+	*msg = b->buf;
+	*len = b->off;
+	return TRUE;
+}
+
+/* Handle one message at input.pos, in place: returns the size consumed, the size needed (if > available), or 0 on error */
 static size_t ws_read_message(PurpleWebsocket *ws) {
-	uint8_t *input = ws->input.buf;
-	size_t len = ws->input.off;
+	uint8_t *input = ws->input.buf + ws->input.pos;
+	size_t len = ws->input.off - ws->input.pos;
 	size_t off = 0;
 	struct {
 		guchar *p;
@@ -191,7 +338,11 @@ static size_t ws_read_message(PurpleWebsocket *ws) {
 		if (len-off < 2)
 			return off+2;
 		uint8_t header = GETB(uint8_t);
-		if (header & ~(WS_OP_MASK|WS_FIN)) {
+		/* compressed messages have RSV1 on the first frame (never control frames) */
+		uint8_t allowed = WS_OP_MASK|WS_FIN;
+		if (ws->deflate && fi == 0 && !(header & WS_OP_CTRL))
+			allowed |= WS_RSV1;
+		if (header & ~allowed) {
 			ws_error(ws, "Unsupported RSV flag");
 			return 0;
 		}
@@ -220,20 +371,24 @@ static size_t ws_read_message(PurpleWebsocket *ws) {
 #undef GETN
 
 		if (header & WS_FIN) {
-			/* consolidate all the fragments after the first */
+			/* consolidate all the fragments after the first (unfragmented messages are not moved) */
 			unsigned i;
 			for (i = 1; i <= fi; i++) {
 				memmove(&frag[0].p[frag[0].l], frag[i].p, frag[i].l);
 				frag[0].l += frag[i].l;
 			}
 
-			purple_debug_misc("websocket", "message %x len %lu\n", input[0], (unsigned long) frag[0].l);
+			if ((input[0] & WS_RSV1) && !ws_inflate(ws, &frag[0].p, &frag[0].l))
+				return 0;
+
+			DEBUG_MISC("websocket", "message %x len %lu\n", input[0], (unsigned long) frag[0].l);
 			uint8_t op = input[0] & WS_OP_MASK;
 			switch (op) {
 				case WS_OP_TEXT:
 				case WS_OP_BIN:
 				case WS_OP_PONG:
 				case WS_OP_CLOS:
+					ws->messages++;
 					ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, frag[0].p, frag[0].l);
 					if (op == WS_OP_CLOS) {
 						ws->closed |= PURPLE_INPUT_READ;
@@ -315,9 +470,14 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 
 	while (cond & PURPLE_INPUT_READ) {
 		g_return_if_fail(ws->input.off < ws->input.len);
+		if (ws->connected && ws->input.pos && ws->input.siz - ws->input.off < ws->input.siz/2)
+			/* make room for a full-size read */
+			buffer_resize(&ws->input, ws->input.siz);
+		size_t avail = ws->input.siz - ws->input.off;
 		ssize_t len = ws->ssl_connection
-			? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off)
-			: read(ws->fd, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off);
+			? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.off, avail)
+			: read(ws->fd, ws->input.buf + ws->input.off, avail);
+		ws->reads++;
 
 		if (len < 0) {
 			if (errno != EAGAIN) {
@@ -325,6 +485,12 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 				return;
 			}
 			cond &= ~PURPLE_INPUT_READ;
+
+			/* idle: shrink if the last burst didn't need the space */
+			if (ws->connected && ws->input.siz > INPUT_MIN && ws->input_peak < ws->input.siz/4)
+				buffer_resize(&ws->input, MAX(ws->input.siz/2, INPUT_MIN));
+			ws->input_peak = 0;
+			ws->input_full = 0;
 		}
 		else if (len == 0) {
 			ws_error(ws, "Connection closed");
@@ -337,6 +503,16 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 			*/
 
 			ws->input.off += len;
+			if ((gsize)len > ws->input_peak)
+				ws->input_peak = len;
+
+			/* grow on sustained full reads (a burst of events) */
+			if ((gsize)len < avail)
+				ws->input_full = 0;
+			else if (++ws->input_full >= 2 && ws->connected && ws->input.siz < ws->input_max) {
+				buffer_resize(&ws->input, MIN(ws->input.siz*2, ws->input_max));
+				ws->input_full = 0;
+			}
 
 			if (!ws->connected) {
 				/* search for the end of headers in the new block (backing up 4-1) */
@@ -353,8 +529,8 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 					if (!ws_read_headers(ws, resp))
 						return;
 
-					memmove(ws->input.buf, eoh, ws->input.off -= eoh - resp);
-					ws->input.len = 2;
+					buffer_consume(&ws->input, eoh - resp);
+					buffer_need(&ws->input, 2);
 				}
 				else if (ws->input.off >= ws->input.len) {
 					ws_error(ws, "Response headers too long");
@@ -368,63 +544,129 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 				size_t r = ws_read_message(ws);
 				if (!r) /* error */
 					return;
-				else if (r > ws->input.off) {
+				else if (r > ws->input.off - ws->input.pos) {
 					/* need more */
-					buffer_set_len(&ws->input, r);
+					buffer_need(&ws->input, r);
 				} else {
-					/* consumed some */
-					memmove(ws->input.buf, ws->input.buf + r, ws->input.off -= r);
-					ws->input.len = 2;
+					/* consumed some: messages are delivered in place, so just move past it */
+					buffer_consume(&ws->input, r);
+					buffer_need(&ws->input, 2);
 				}
 			}
 		}
 	}
 }
 
-void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+/* the mask to use for data starting at off within a payload */
+static uint32_t ws_mask_at(uint32_t mask, size_t off) {
+	uint8_t m[8];
+	memcpy(&m[0], &mask, 4);
+	memcpy(&m[4], &mask, 4);
+	memcpy(&mask, &m[off & 3], 4);
+	return mask;
+}
+
+/* p = msg ^ mask (repeated in memory order) */
+static void ws_mask(guchar *p, const guchar *msg, size_t len, uint32_t mask) {
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i m128 = _mm_set1_epi32(mask);
+	for (; i+15 < len; i+=16)
+		_mm_storeu_si128((__m128i*)&p[i], _mm_xor_si128(_mm_loadu_si128((const __m128i*)&msg[i]), m128));
+#endif
+	uint64_t m64 = (uint64_t)mask << 32 | mask;
+	for (; i+7 < len; i+=8) {
+		uint64_t m;
+		memcpy(&m, &msg[i], 8);
+		m ^= m64;
+		memcpy(&p[i], &m, 8);
+	}
+	for (; i < len; i++)
+		p[i] = msg[i] ^ ((uint8_t*)&mask)[i&3];
+}
+
+void purple_websocket_sendv(PurpleWebsocket *ws, PurpleWebsocketOp op, const PurpleWebsocketVec *vec, unsigned count) {
 	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
 	g_return_if_fail(!(op & ~WS_OP_MASK));
 	gboolean buf = ws->output.len;
 
-#define ADDB(V) (*(uint8_t*)buffer_incr(&ws->output, 1) = (V))
-#define ADD(T, V) ({ \
-		T _v = (V); \
-		memcpy(buffer_incr(&ws->output, sizeof(T)), &_v, sizeof(T)); \
-	})
+	size_t len = 0;
+	unsigned i;
+	for (i = 0; i < count; i++)
+		len += vec[i].len;
+
+	uint8_t rsv = 0;
+	PurpleWebsocketVec deflated;
+	if (ws->deflate && !(op & WS_OP_CTRL) && len >= DEFLATE_MIN) {
+		z_stream *z = &ws->deflate_z;
+		struct buffer *b = &ws->deflated;
+		b->off = 0;
+		for (i = 0; i < count; i++) {
+			z->next_in = (Bytef *)vec[i].base;
+			z->avail_in = vec[i].len;
+			do {
+				if (b->off == b->siz)
+					buffer_set_len(b, MAX(2*b->siz, 4096));
+				z->next_out = b->buf + b->off;
+				z->avail_out = b->siz - b->off;
+				deflate(z, i+1 < count ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+				b->off = z->next_out - b->buf;
+			} while (!z->avail_out);
+		}
+		/* strip the 00 00 ff ff the sync flush ends with */
+		g_warn_if_fail(b->off >= 4 && !memcmp(&b->buf[b->off-4], "\x00\x00\xff\xff", 4));
+		if (ws->deflate_reset)
+			deflateReset(z);
+
+		deflated.base = b->buf;
+		deflated.len = len = b->off - 4;
+		vec = &deflated;
+		count = 1;
+		rsv = WS_RSV1;
+	}
+
+	/* reserve the whole frame at once and fill it in place */
+	size_t hlen = 2 + (len > UINT16_MAX ? 8 : len >= 126 ? 2 : 0) + 4;
+	guchar *p = buffer_incr(&ws->output, hlen + len);
 
-	ADDB(WS_FIN | op);
+	*p++ = WS_FIN | rsv | op;
 	if (len > UINT16_MAX) {
-		ADDB(WS_MASK | 127);
-		ADD(uint64_t, GUINT64_TO_BE(len));
+		*p++ = WS_MASK | 127;
+		uint64_t l = GUINT64_TO_BE(len);
+		memcpy(p, &l, 8);
+		p += 8;
 	} else if (len >= 126) {
-		ADDB(WS_MASK | 126);
-		ADD(uint16_t, GUINT16_TO_BE(len));
+		*p++ = WS_MASK | 126;
+		uint16_t l = GUINT16_TO_BE(len);
+		memcpy(p, &l, 2);
+		p += 2;
 	} else {
-		ADDB(WS_MASK | len);
+		*p++ = WS_MASK | len;
 	}
 
 	uint32_t mask = g_random_int();
-	ADD(uint32_t, mask);
-
-#undef ADD
-#undef ADDB
+	memcpy(p, &mask, 4);
+	p += 4;
 
-	guchar *p = buffer_incr(&ws->output, len);
-	size_t i;
-	for (i = 0; i+3 < len; i+=4) {
-		uint32_t m = *(uint32_t*)&msg[i] ^ mask;
-		memcpy(&p[i], &m, 4);
+	size_t off = 0;
+	for (i = 0; i < count; i++) {
+		ws_mask(&p[off], vec[i].base, vec[i].len, ws_mask_at(mask, off));
+		off += vec[i].len;
 	}
-	for (; i < len; i++)
-		p[i] = msg[i] ^ ((uint8_t*)&mask)[i&3];
 
 	if (op == PURPLE_WEBSOCKET_CLOSE)
 		ws->closed |= PURPLE_INPUT_WRITE;
 
+	/* if output was already pending, this frame goes out with the same write */
 	if (!buf)
 		ws_input(ws);
 }
 
+void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	PurpleWebsocketVec vec = { msg, len };
+	purple_websocket_sendv(ws, op, &vec, 1);
+}
+
 static void wss_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleInputCondition cond)
 {
 	PurpleWebsocket *ws = data;
@@ -488,6 +730,7 @@ PurpleWebsocket *purple_websocket_connect(PurpleAccount *account,
 	ws->callback = callback;
 	ws->user_data = user_data;
 	ws->fd = -1;
+	ws->input_max = INPUT_MAX_DEFAULT;
 
 	char *host, *path;
 	int port;
@@ -512,7 +755,8 @@ Host: %s\r\n\
 Connection: Upgrade\r\n\
 Upgrade: websocket\r\n\
 Sec-WebSocket-Key: %s\r\n\
-Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
+Sec-WebSocket-Version: 13\r\n\
+Sec-WebSocket-Extensions: permessage-deflate\r\n", path, host, ws->key);
 		if (protocol)
 			g_string_append_printf(request, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 		g_string_append(request, "\r\n");
@@ -542,3 +786,13 @@ Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
 
 	return ws;
 }
+
+void purple_websocket_set_input_max(PurpleWebsocket *ws, size_t max) {
+	ws->input_max = MAX(max, INPUT_MIN);
+}
+
+void purple_websocket_get_counts(PurpleWebsocket *ws, unsigned long *reads, unsigned long *messages, size_t *bufsize) {
+	*reads = ws->reads;
+	*messages = ws->messages;
+	*bufsize = ws->input.siz;
+}
@@ -15,10 +15,23 @@ typedef enum _PurpleWebsocketOp {
 	PURPLE_WEBSOCKET_OPEN   = 0x10,
 } PurpleWebsocketOp;
 
+/* One piece of an outgoing message, like struct iovec */
+typedef struct _PurpleWebsocketVec {
+	const void *base;
+	size_t len;
+} PurpleWebsocketVec;
+
 typedef void (*PurpleWebsocketCallback)(PurpleWebsocket *ws, gpointer user_data, PurpleWebsocketOp op, const guchar *msg, size_t len);
 
 PurpleWebsocket *purple_websocket_connect(PurpleAccount *account, const char *url, const char *protocol, PurpleWebsocketCallback callback, void *user_data);
 void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len);
+/* Send the concatenation of count segments as a single frame */
+void purple_websocket_sendv(PurpleWebsocket *ws, PurpleWebsocketOp op, const PurpleWebsocketVec *vec, unsigned count);
 void purple_websocket_abort(PurpleWebsocket *ws);
 
+/* Limit how large the receive buffer may grow during bursts (frames larger than this are still accepted) */
+void purple_websocket_set_input_max(PurpleWebsocket *ws, size_t max);
+/* Read calls and messages delivered so far, and the current receive buffer size */
+void purple_websocket_get_counts(PurpleWebsocket *ws, unsigned long *reads, unsigned long *messages, size_t *bufsize);
+
 #endif
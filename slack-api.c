@@ -1,4 +1,4 @@
-#include <debug.h>
+#include "purple-debug.h"
 
 #include "slack-api.h"
 #include "slack-json.h"
@@ -14,72 +14,360 @@ PurpleConnectionError slack_api_connection_error(const gchar *error) {
 	return PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
 }
 
+/* most requests (below interactive priority) outstanding at once */
+#define API_MAX_IN_FLIGHT 8
+
+/* Slack's published rate limit tiers, in requests per minute (0 is unlimited) */
+static const unsigned api_tier_rate[] = { 0, 1, 20, 50, 100 };
+#define API_TIERS G_N_ELEMENTS(api_tier_rate)
+
+static const struct api_method {
+	const char *name;
+	unsigned tier;
+	SlackAPIPriority priority;
+	gboolean shared; /* read-only: identical concurrent calls can share a response */
+	gboolean idempotent; /* safe to pipeline, and to send again if the connection drops */
+} api_methods[] = {
+	{ "rtm.connect",		1, SLACK_API_DEFAULT, FALSE, TRUE },
+	{ "users.list",			2, SLACK_API_DEFAULT, TRUE, TRUE },
+	{ "conversations.list",		2, SLACK_API_DEFAULT, TRUE, TRUE },
+	{ "users.setPresence",		2, SLACK_API_INTERACTIVE },
+	{ "channels.list",		2, SLACK_API_BULK, TRUE, TRUE },
+	{ "groups.list",		2, SLACK_API_BULK, TRUE, TRUE },
+	{ "mpim.list",			2, SLACK_API_BULK, TRUE, TRUE },
+	{ "conversations.history",	3, SLACK_API_HISTORY, TRUE, TRUE },
+	{ "chat.command",		3, SLACK_API_INTERACTIVE },
+	{ "im.open",			3, SLACK_API_INTERACTIVE },
+	{ "channels.join",		3, SLACK_API_INTERACTIVE },
+	{ "conversations.invite",	3, SLACK_API_INTERACTIVE },
+	{ "conversations.setTopic",	3, SLACK_API_INTERACTIVE },
+	{ "users.profile.set",		3, SLACK_API_INTERACTIVE },
+	{ "conversations.info",		3, SLACK_API_DEFAULT, TRUE, TRUE },
+	{ "channels.info",		3, SLACK_API_DEFAULT, TRUE, TRUE },
+	{ "groups.info",		3, SLACK_API_DEFAULT, TRUE, TRUE },
+	{ "users.info",			4, SLACK_API_DEFAULT, TRUE, TRUE },
+};
+/* anything else */
+static const struct api_method api_method_default = { NULL, 3, SLACK_API_DEFAULT };
+/* slack_api_fetch */
+static const struct api_method api_method_fetch = { NULL, 0, SLACK_API_AVATAR, FALSE, TRUE };
+
+/* longest we'll back off repeated ratelimiting (unless told otherwise) */
+#define API_BACKOFF_MAX (10*60*G_USEC_PER_SEC)
+
+struct api_bucket {
+	double tokens;
+	gint64 updated;
+	gint64 paused_until; /* after being ratelimited */
+	unsigned strikes; /* consecutive ratelimited responses */
+};
+
+struct _SlackAPIScheduler {
+	GQueue queue[SLACK_API_PRIORITIES]; /* SlackAPICall waiting to be sent */
+	struct api_bucket bucket[API_TIERS];
+	unsigned in_flight;
+	guint timer; /* waiting for tokens */
+	gint64 timer_due;
+	GHashTable *shared; /* url -> SlackAPICall being shared */
+};
+
 struct _SlackAPICall {
 	SlackAccount *sa;
 	char *url;
-	PurpleUtilFetchUrlData *fetch;
+	const struct api_method *method;
+	SlackAPIPriority priority;
+	gsize max_len;
+	PurpleHttpRequest *fetch;
 	SlackAPICallback *callback;
+	SlackAPIFetchCallback *raw; /* instead of callback, for slack_api_fetch */
+	unsigned redirects;
+	SlackAPICall *leader; /* sharing this call's response */
+	GSList *followers; /* SlackAPICall sharing our response */
+	const char *stream; /* array property to stream to element */
+	SlackAPIElementCallback *element;
 	gpointer data;
 
 	SlackAPICall **prev, *next;
 };
 
-static void api_error(SlackAPICall *call, const char *error) {
+static const struct api_method *api_method_lookup(const char *pfx, const char *method) {
+	size_t plen = strlen(pfx);
+	unsigned i;
+	for (i = 0; i < G_N_ELEMENTS(api_methods); i++) {
+		const char *name = api_methods[i].name;
+		if (!strncmp(name, pfx, plen) && !strcmp(name + plen, method))
+			return &api_methods[i];
+	}
+	return &api_method_default;
+}
+
+/* Take a token from the tier's bucket, or return how many ms until there is one */
+static guint api_bucket_take(struct api_bucket *bucket, unsigned tier) {
+	unsigned rate = api_tier_rate[tier];
+	if (!rate)
+		return 0;
+
+	gint64 now = g_get_monotonic_time();
+	if (now < bucket->paused_until)
+		return 1 + (bucket->paused_until - now) / 1000;
+
+	/* start full: up to a minute's worth at once */
+	if (!bucket->updated)
+		bucket->tokens = rate;
+	else
+		bucket->tokens = MIN(rate, bucket->tokens + (now - bucket->updated) * rate / 60e6);
+	bucket->updated = now;
+
+	if (bucket->tokens < 1)
+		return 1 + (1 - bucket->tokens) * 60000 / rate;
+	bucket->tokens -= 1;
+	return 0;
+}
+
+/* Remove from the list of outstanding calls (and from sharing) before completion */
+static void api_unlink(SlackAPICall *call) {
+	SlackAPIScheduler *sched = call->sa->api_sched;
 	if ((*call->prev = call->next))
 		call->next->prev = call->prev;
-	if (call->callback)
-		call->callback(call->sa, call->data, NULL, error);
+	if (call->leader)
+		call->leader->followers = g_slist_remove(call->leader->followers, call);
+	else if (sched && call->method->shared && g_hash_table_lookup(sched->shared, call->url) == call)
+		g_hash_table_remove(sched->shared, call->url);
+}
+
+/* Take the calls waiting on this one's response, to complete after it */
+static GSList *api_take_followers(SlackAPICall *call) {
+	GSList *followers = call->followers, *l;
+	call->followers = NULL;
+	for (l = followers; l; l = l->next)
+		((SlackAPICall *)l->data)->leader = NULL;
+	return followers;
+}
+
+static void api_free(SlackAPICall *call) {
 	g_free(call->url);
 	g_free(call);
+}
+
+static void api_error(SlackAPICall *call, const char *error) {
+	GSList *followers = api_take_followers(call), *l;
+	api_unlink(call);
+	if (call->raw)
+		call->raw(call->sa, call->data, NULL, 0, error);
+	else if (call->callback)
+		call->callback(call->sa, call->data, NULL, error);
+	api_free(call);
+
+	for (l = followers; l; l = l->next)
+		api_error(l->data, error);
+	g_slist_free(followers);
 };
 
-static gboolean api_retry(gpointer data);
+static void api_schedule(SlackAccount *sa);
+
+static gboolean api_schedule_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->api_sched->timer = 0;
+	api_schedule(sa);
+	return FALSE;
+}
+
+static void api_done(SlackAccount *sa) {
+	sa->api_sched->in_flight--;
+	api_schedule(sa);
+}
+
+static void api_queue(SlackAPICall *call) {
+	if (!call->sa->api_sched) {
+		/* called back during slack_api_disconnect */
+		api_error(call, "disconnected");
+		return;
+	}
+	g_queue_push_tail(&call->sa->api_sched->queue[call->priority], call);
+	api_schedule(call->sa);
+}
+
+/* Pause the call's whole tier for as long as the server says (or longer, if this keeps happening), and requeue it */
+static void api_ratelimited(SlackAPICall *call, PurpleHttpRequest *fetch) {
+	SlackAccount *sa = call->sa;
+	struct api_bucket *bucket = &sa->api_sched->bucket[call->method->tier];
+	gint64 now = g_get_monotonic_time();
+
+	/* other calls sent before the pause are expected to be limited too */
+	if (now >= bucket->paused_until) {
+		gchar *retry_after = purple_http_request_get_header(fetch, "Retry-After");
+		gint64 delay = retry_after ? g_ascii_strtoll(retry_after, NULL, 10) : 0;
+		g_free(retry_after);
+		if (delay <= 0)
+			delay = purple_account_get_int(sa->account, "ratelimit_delay", 15);
+		delay *= G_USEC_PER_SEC;
+
+		if (bucket->strikes) {
+			/* exponential, jittered, but never sooner than requested */
+			gint64 backoff = MIN(delay << MIN(bucket->strikes, 8), API_BACKOFF_MAX);
+			backoff += g_random_int_range(0, backoff / 4 / 1000 + 1) * (gint64)1000;
+			delay = MAX(delay, backoff);
+		}
+		bucket->strikes++;
 
-static void api_cb(G_GNUC_UNUSED PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
+		DEBUG_WARNING("slack", "ratelimited on tier %u: pausing %" G_GINT64_FORMAT "ms\n", call->method->tier, delay / 1000);
+		bucket->paused_until = now + delay;
+		/* resume gently */
+		bucket->updated = bucket->paused_until;
+		bucket->tokens = 1;
+	}
+
+	/* first in line when the tier resumes */
+	g_queue_push_head(&sa->api_sched->queue[call->priority], call);
+}
+
+static void api_cb(PurpleHttpRequest *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
 	SlackAPICall *call = data;
+	SlackAccount *sa = call->sa;
+	call->fetch = NULL;
 
-	purple_debug_misc("slack", "api response: %s\n", error ?: buf);
+	if (call->raw) {
+		int status = error ? 0 : purple_http_request_get_status(fetch);
+		if (status / 100 == 3 && call->redirects++ < 5) {
+			gchar *location = purple_http_request_get_header(fetch, "Location");
+			if (location) {
+				g_free(call->url);
+				call->url = location;
+				api_done(sa);
+				api_queue(call);
+				return;
+			}
+		}
+		if (!error && status / 100 != 2)
+			error = "Unexpected HTTP response";
+		api_unlink(call);
+		call->raw(sa, call->data, buf, len, error);
+		api_free(call);
+		api_done(sa);
+		return;
+	}
+
+	if (error)
+		DEBUG_MISC("slack", "api error: %s\n", error);
+	else
+		DEBUG_MISC("slack", "api response: %.*s\n", slack_debug_payload_len(len), buf);
 	if (error) {
 		api_error(call, error);
+		api_done(sa);
+		return;
+	}
+
+	if (purple_http_request_get_status(fetch) == 429) {
+		api_ratelimited(call, fetch);
+		api_done(sa);
 		return;
 	}
 
-	json_value *json = json_parse(buf, len);
+	/* the response is only valid during the callback: anything kept must be copied */
+	SlackJSONArena *arena = sa->api_arena;
+	SlackJSONStream stream;
+	json_value *json = call->stream
+		? slack_json_arena_parse_stream(arena, buf, len, call->stream, &stream)
+		: slack_json_arena_parse(arena, buf, len);
 	if (!json) {
 		api_error(call, "Invalid JSON response");
+		slack_json_arena_reset(arena);
+		api_done(sa);
 		return;
 	}
 
 	if (!json_get_prop_boolean(json, "ok", FALSE)) {
 		const char *err = json_get_prop_strptr(json, "error");
 		if (!g_strcmp0(err, "ratelimited")) {
-			/* #27: correct thing to do on 429 status is parse the "Retry-After" header and wait that many seconds,
-			 * but getting access to the headers here requires more work, so we just heuristically make up a number... */
-			purple_timeout_add_seconds(purple_account_get_int(call->sa->account, "ratelimit_delay", 15), api_retry, call);
-			json_value_free(json);
+			api_ratelimited(call, fetch);
+			slack_json_arena_reset(arena);
+			api_done(sa);
 			return;
 		}
 		api_error(call, err ?: "Unknown error");
-		json_value_free(json);
+		slack_json_arena_reset(arena);
+		api_done(sa);
 		return;
 	}
 
-	if ((*call->prev = call->next))
-		call->next->prev = call->prev;
+	sa->api_sched->bucket[call->method->tier].strikes = 0;
+
+	if (call->stream) {
+		json_value *elem;
+		while ((elem = slack_json_stream_next(&stream)))
+			call->element(sa, call->data, elem);
+	}
+
+	GSList *followers = api_take_followers(call), *l;
+	api_unlink(call);
 	if (call->callback)
-		call->callback(call->sa, call->data, json, NULL);
+		call->callback(sa, call->data, json, NULL);
+	api_free(call);
 
-	json_value_free(json);
-	g_free(call->url);
-	g_free(call);
+	for (l = followers; l; l = l->next) {
+		SlackAPICall *follower = l->data;
+		api_unlink(follower);
+		if (follower->callback)
+			follower->callback(sa, follower->data, json, NULL);
+		api_free(follower);
+	}
+	g_slist_free(followers);
+
+	slack_json_arena_reset(arena);
+	api_done(sa);
 }
 
-static gboolean api_retry(gpointer data) {
-	SlackAPICall *call = data;
-	call->fetch = purple_util_fetch_url_request_len_with_account(call->sa->account,
-			call->url, TRUE, NULL, TRUE, NULL, FALSE, 4096*1024,
-			api_cb, call);
-	return FALSE;
+/* Returns FALSE (having sent nothing) if the url is no good */
+static gboolean api_send(SlackAPICall *call) {
+	call->fetch = purple_http_request(call->sa->api_pool, call->url, call->max_len, call->method->idempotent, api_cb, call);
+	if (!call->fetch)
+		return FALSE;
+	call->sa->api_sched->in_flight++;
+	return TRUE;
+}
+
+/* Send queued calls, highest priority first, as far as the in-flight limit and each tier's tokens allow */
+static void api_schedule(SlackAccount *sa) {
+	SlackAPIScheduler *sched = sa->api_sched;
+	guint wait = 0;
+	SlackAPIPriority p;
+	GSList *invalid = NULL; /* failed once we're done with the queues, as their callbacks may schedule more */
+
+	for (p = 0; p < SLACK_API_PRIORITIES; p++) {
+		/* interactive calls don't wait for bulk ones to finish */
+		if (p != SLACK_API_INTERACTIVE && sched->in_flight >= API_MAX_IN_FLIGHT)
+			break;
+
+		GList *l = sched->queue[p].head;
+		while (l && (p == SLACK_API_INTERACTIVE || sched->in_flight < API_MAX_IN_FLIGHT)) {
+			SlackAPICall *call = l->data;
+			GList *next = l->next;
+			guint w = api_bucket_take(&sched->bucket[call->method->tier], call->method->tier);
+			if (w) {
+				/* this tier is out: later calls in other tiers can still go */
+				if (!wait || w < wait)
+					wait = w;
+			} else {
+				g_queue_delete_link(&sched->queue[p], l);
+				if (!api_send(call))
+					invalid = g_slist_prepend(invalid, call);
+			}
+			l = next;
+		}
+	}
+
+	gint64 due = g_get_monotonic_time() + wait * (gint64)1000;
+	if (wait && !(sched->timer && sched->timer_due <= due)) {
+		if (sched->timer)
+			purple_timeout_remove(sched->timer);
+		sched->timer = purple_timeout_add(wait, api_schedule_cb, sa);
+		sched->timer_due = due;
+	}
+
+	invalid = g_slist_reverse(invalid);
+	for (GSList *i = invalid; i; i = i->next)
+		api_error(i->data, "Invalid API URL");
+	g_slist_free(invalid);
 }
 
 static GString *slack_api_encode_url(SlackAccount *sa, const char *pfx, const char *method, va_list qargs) {
@@ -95,19 +383,54 @@ static GString *slack_api_encode_url(SlackAccount *sa, const char *pfx, const ch
 	return url;
 }
 
-static void slack_api_call_url(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const char *url) {
+static SlackAPICall *api_call_new(SlackAccount *sa, const char *url, gpointer user_data) {
 	SlackAPICall *call = g_new0(SlackAPICall, 1);
 	call->sa = sa;
-	call->callback = callback;
 	call->url = g_strdup(url);
 	call->data = user_data;
+	call->max_len = 4096*1024;
 	if ((call->next = sa->api_calls))
 		call->next->prev = &call->next;
 	call->prev = &sa->api_calls;
 	sa->api_calls = call;
+	return call;
+}
+
+/* priority SLACK_API_PRIORITIES means the method's usual one */
+static void slack_api_call_url(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback callback, const char *stream, SlackAPIElementCallback *element, gpointer user_data, const char *pfx, const char *method, const char *url) {
+	SlackAPICall *call = api_call_new(sa, url, user_data);
+	call->callback = callback;
+	call->stream = stream;
+	call->element = element;
+	call->method = api_method_lookup(pfx, method);
+	call->priority = priority < SLACK_API_PRIORITIES ? priority : call->method->priority;
+
+	SlackAPIScheduler *sched = sa->api_sched;
+	if (sched && call->method->shared && !stream) {
+		SlackAPICall *leader = g_hash_table_lookup(sched->shared, call->url);
+		if (leader) {
+			DEBUG_MISC("slack", "api call (shared): %s\n", url);
+			call->leader = leader;
+			leader->followers = g_slist_append(leader->followers, call);
+			return;
+		}
+		g_hash_table_insert(sched->shared, call->url, call);
+	}
 
-	purple_debug_misc("slack", "api call: %s\n", url);
-	api_retry(call);
+	DEBUG_MISC("slack", "api call: %s\n", url);
+	api_queue(call);
+}
+
+void slack_api_fetch(SlackAccount *sa, SlackAPIFetchCallback callback, gpointer user_data, const char *url, gsize max_len) {
+	SlackAPICall *call = api_call_new(sa, url, user_data);
+	call->raw = callback;
+	call->max_len = max_len;
+	/* not an API method, so no tier limit */
+	call->method = &api_method_fetch;
+	call->priority = SLACK_API_AVATAR;
+
+	DEBUG_MISC("slack", "fetch: %s\n", url);
+	api_queue(call);
 }
 
 void slack_api_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const char *method, ...)
@@ -117,10 +440,43 @@ void slack_api_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_d
 	GString *url = slack_api_encode_url(sa, "", method, qargs);
 	va_end(qargs);
 
-	slack_api_call_url(sa, callback, user_data, url->str);
+	slack_api_call_url(sa, SLACK_API_PRIORITIES, callback, NULL, NULL, user_data, "", method, url->str);
+	g_string_free(url, TRUE);
+}
+
+void slack_api_call_stream(SlackAccount *sa, SlackAPICallback callback, const char *prop, SlackAPIElementCallback *element, gpointer user_data, const char *method, ...)
+{
+	va_list qargs;
+	va_start(qargs, method);
+	GString *url = slack_api_encode_url(sa, "", method, qargs);
+	va_end(qargs);
+
+	slack_api_call_url(sa, SLACK_API_PRIORITIES, callback, prop, element, user_data, "", method, url->str);
 	g_string_free(url, TRUE);
 }
 
+void slack_api_call_stream_priority(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback callback, const char *prop, SlackAPIElementCallback *element, gpointer user_data, const char *method, ...)
+{
+	va_list qargs;
+	va_start(qargs, method);
+	GString *url = slack_api_encode_url(sa, "", method, qargs);
+	va_end(qargs);
+
+	slack_api_call_url(sa, priority, callback, prop, element, user_data, "", method, url->str);
+	g_string_free(url, TRUE);
+}
+
+unsigned slack_api_queued(SlackAccount *sa, SlackAPIPriority priority) {
+	SlackAPIScheduler *sched = sa->api_sched;
+	unsigned n = 0;
+	SlackAPIPriority p;
+	if (!sched)
+		return 0;
+	for (p = 0; p <= priority && p < SLACK_API_PRIORITIES; p++)
+		n += g_queue_get_length(&sched->queue[p]);
+	return n;
+}
+
 gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, SlackObject *obj, const char *method, ...) {
 	g_return_val_if_fail(obj, FALSE);
 	const char *type = NULL, *id = NULL;
@@ -157,14 +513,37 @@ gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpo
 	va_end(qargs);
 	g_string_append_printf(url, "&channel=%s", purple_url_encode(id));
 
-	slack_api_call_url(sa, callback, user_data, url->str);
+	slack_api_call_url(sa, SLACK_API_PRIORITIES, callback, NULL, NULL, user_data, type, method, url->str);
 	g_string_free(url, TRUE);
 	return TRUE;
 }
 
+void slack_api_init(SlackAccount *sa) {
+	sa->api_pool = purple_http_pool_new(sa->account, 4, 4);
+	sa->api_arena = slack_json_arena_new();
+	sa->api_sched = g_new0(SlackAPIScheduler, 1);
+	sa->api_sched->shared = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
 void slack_api_disconnect(SlackAccount *sa) {
+	SlackAPIScheduler *sched = sa->api_sched;
+	sa->api_sched = NULL;
+	SlackAPIPriority p;
+	for (p = 0; p < SLACK_API_PRIORITIES; p++)
+		g_queue_clear(&sched->queue[p]);
+	if (sched->timer)
+		purple_timeout_remove(sched->timer);
+
 	while (sa->api_calls) {
-		purple_util_fetch_url_cancel(sa->api_calls->fetch);
+		if (sa->api_calls->fetch)
+			purple_http_request_cancel(sa->api_calls->fetch);
 		api_error(sa->api_calls, "disconnected");
 	}
+
+	g_hash_table_destroy(sched->shared);
+	g_free(sched);
+	purple_http_pool_free(sa->api_pool);
+	sa->api_pool = NULL;
+	slack_json_arena_free(sa->api_arena);
+	sa->api_arena = NULL;
 }
@@ -8,10 +8,36 @@
 PurpleConnectionError slack_api_connection_error(const gchar *error);
 
 typedef struct _SlackAPICall SlackAPICall;
+typedef struct _SlackAPIScheduler SlackAPIScheduler;
+
+/* Queued calls are sent in this order, each method subject to its rate limit tier */
+typedef enum {
+	SLACK_API_INTERACTIVE, /* user actions (not subject to the in-flight limit) */
+	SLACK_API_DEFAULT,
+	SLACK_API_HISTORY,
+	SLACK_API_AVATAR,
+	SLACK_API_BULK,
+	SLACK_API_PRIORITIES
+} SlackAPIPriority;
+
 typedef void SlackAPICallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
 
 void slack_api_call(SlackAccount *sa, SlackAPICallback *callback, gpointer user_data, const char *method, /* const char *query_param1, const char *query_value1, */ ...) G_GNUC_NULL_TERMINATED;
+
+typedef void SlackAPIElementCallback(SlackAccount *sa, gpointer user_data, json_value *elem);
+/* Like slack_api_call, but each element of the (large) top-level array property is parsed and passed to element one at a time (on success only), before callback is called with the rest of the response (where the property is empty) */
+void slack_api_call_stream(SlackAccount *sa, SlackAPICallback *callback, const char *prop, SlackAPIElementCallback *element, gpointer user_data, const char *method, ...) G_GNUC_NULL_TERMINATED;
+/* Like slack_api_call_stream, but queued at the given priority rather than the method's usual one */
+void slack_api_call_stream_priority(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback *callback, const char *prop, SlackAPIElementCallback *element, gpointer user_data, const char *method, ...) G_GNUC_NULL_TERMINATED;
+/* How many calls are waiting to be sent at this priority or more urgent ones */
+unsigned slack_api_queued(SlackAccount *sa, SlackAPIPriority priority);
 gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, SlackObject *obj, const char *method, ...) G_GNUC_NULL_TERMINATED;
+
+typedef void SlackAPIFetchCallback(SlackAccount *sa, gpointer user_data, const gchar *buf, gsize len, const char *error);
+/* Download a (non-API) url at avatar priority, following redirects, with callback called on completion (or error or disconnect) */
+void slack_api_fetch(SlackAccount *sa, SlackAPIFetchCallback *callback, gpointer user_data, const char *url, gsize max_len);
+
+void slack_api_init(SlackAccount *sa);
 void slack_api_disconnect(SlackAccount *sa);
 
 #define SLACK_PAGINATE_LIMIT	"limit", "100"
@@ -0,0 +1,291 @@
+#include <sys/stat.h>
+
+#include <debug.h>
+#include <util.h>
+
+#include "slack-json.h"
+#include "slack-user.h"
+#include "slack-channel.h"
+#include "slack-im.h"
+#include "slack-cache.h"
+
+/* The file is a header ("SLKC", version byte), then records, each a kind byte followed by its fields.
+ * Strings are a little-endian 16-bit length and that many bytes plus a NUL, so they can be used in place once loaded. */
+#define CACHE_MAGIC	"SLKC"
+#define CACHE_VERSION	1
+#define CACHE_NULL	0xffff /* length of a NULL string */
+
+enum cache_kind {
+	CACHE_END	= 0,
+	CACHE_USER	= 'U', /* id, name, status, avatar_hash, avatar_url */
+	CACHE_CHANNEL	= 'C', /* id, name, type byte */
+	CACHE_IM	= 'I', /* id, user id, open byte */
+};
+
+static char *cache_file(SlackAccount *sa) {
+	if (!sa->team.id || !sa->self || !purple_account_get_bool(sa->account, "cache", TRUE))
+		return NULL;
+	return g_strdup_printf("%s" G_DIR_SEPARATOR_S "slack" G_DIR_SEPARATOR_S "%s-%s.cache", purple_user_dir(), sa->team.id, sa->self->object.id);
+}
+
+static void cache_put_str(GString *buf, const char *s) {
+	size_t len = s ? strlen(s) : CACHE_NULL;
+	if (len >= CACHE_NULL) {
+		s = NULL;
+		len = CACHE_NULL;
+	}
+	g_string_append_c(buf, len & 0xff);
+	g_string_append_c(buf, len >> 8);
+	if (s)
+		g_string_append_len(buf, s, len + 1);
+}
+
+struct cache_reader {
+	const char *p, *end;
+};
+
+static gboolean cache_get_byte(struct cache_reader *r, guint8 *b) {
+	if (r->p >= r->end)
+		return FALSE;
+	*b = *r->p++;
+	return TRUE;
+}
+
+static gboolean cache_get_str(struct cache_reader *r, const char **s) {
+	if (r->end - r->p < 2)
+		return FALSE;
+	size_t len = (guint8)r->p[0] | (guint8)r->p[1] << 8;
+	r->p += 2;
+	if (len == CACHE_NULL) {
+		*s = NULL;
+		return TRUE;
+	}
+	if ((size_t)(r->end - r->p) <= len || r->p[len])
+		return FALSE;
+	*s = r->p;
+	r->p += len + 1;
+	return TRUE;
+}
+
+/* Just enough of a json object to hand to the usual update functions.
+ * Not being one of slack-json's documents, json_get_prop always searches it linearly, whatever its size. */
+#define CACHE_PROPS_MAX 5
+
+struct cache_object {
+	json_value obj;
+	json_object_entry entries[CACHE_PROPS_MAX];
+	json_value values[CACHE_PROPS_MAX];
+};
+
+static json_value *cache_object_init(struct cache_object *o) {
+	memset(&o->obj, 0, sizeof(o->obj));
+	o->obj.type = json_object;
+	o->obj.u.object.values = o->entries;
+	return &o->obj;
+}
+
+static json_value *cache_prop(struct cache_object *o, const char *name) {
+	unsigned i = o->obj.u.object.length++;
+	g_assert(i < CACHE_PROPS_MAX);
+	o->entries[i].name = (json_char *)name;
+	o->entries[i].name_length = strlen(name);
+	o->entries[i].value = &o->values[i];
+	memset(&o->values[i], 0, sizeof(o->values[i]));
+	o->values[i].parent = &o->obj;
+	return &o->values[i];
+}
+
+static void cache_prop_str(struct cache_object *o, const char *name, const char *s) {
+	json_value *val = cache_prop(o, name);
+	if (!s)
+		return; /* json_none */
+	val->type = json_string;
+	val->u.string.length = strlen(s);
+	val->u.string.ptr = (json_char *)s;
+}
+
+static void cache_prop_object(struct cache_object *o, const char *name, struct cache_object *child) {
+	json_value *val = cache_prop(o, name);
+	o->entries[o->obj.u.object.length-1].value = cache_object_init(child);
+	child->obj.parent = val->parent;
+}
+
+static void cache_prop_bool(struct cache_object *o, const char *name, gboolean b) {
+	json_value *val = cache_prop(o, name);
+	val->type = json_boolean;
+	val->u.boolean = b;
+}
+
+static gboolean cache_load_user(SlackAccount *sa, struct cache_reader *r) {
+	const char *id, *name, *status, *avatar_hash, *avatar_url;
+	if (!(cache_get_str(r, &id) && cache_get_str(r, &name) && cache_get_str(r, &status)
+			&& cache_get_str(r, &avatar_hash) && cache_get_str(r, &avatar_url)))
+		return FALSE;
+	if (slack_object_hash_table_lookup(sa->users, id))
+		return TRUE;
+
+	struct cache_object user, profile;
+	cache_object_init(&user);
+	cache_prop_str(&user, "id", id);
+	cache_prop_str(&user, "name", name);
+	cache_prop_object(&user, "profile", &profile);
+	cache_prop_str(&profile, "status_text", status);
+	cache_prop_str(&profile, "avatar_hash", avatar_hash);
+	cache_prop_str(&profile, "image_192", avatar_url);
+	slack_user_update(sa, &user.obj);
+	return TRUE;
+}
+
+static gboolean cache_load_channel(SlackAccount *sa, struct cache_reader *r) {
+	const char *id, *name;
+	guint8 type;
+	if (!(cache_get_str(r, &id) && cache_get_str(r, &name) && cache_get_byte(r, &type)))
+		return FALSE;
+	if (slack_object_hash_table_lookup(sa->channels, id))
+		return TRUE;
+
+	struct cache_object chan;
+	cache_object_init(&chan);
+	cache_prop_str(&chan, "id", id);
+	cache_prop_str(&chan, "name", name);
+	switch (type) {
+		case SLACK_CHANNEL_PUBLIC:
+			cache_prop_bool(&chan, "is_channel", TRUE);
+			break;
+		case SLACK_CHANNEL_MEMBER:
+			cache_prop_bool(&chan, "is_member", TRUE);
+			break;
+		case SLACK_CHANNEL_GROUP:
+			cache_prop_bool(&chan, "is_group", TRUE);
+			break;
+		case SLACK_CHANNEL_MPIM:
+			cache_prop_bool(&chan, "is_mpim", TRUE);
+			break;
+		default:
+			return TRUE;
+	}
+	slack_channel_set(sa, &chan.obj, SLACK_CHANNEL_UNKNOWN);
+	return TRUE;
+}
+
+static gboolean cache_load_im(SlackAccount *sa, struct cache_reader *r) {
+	const char *id, *user;
+	guint8 open;
+	if (!(cache_get_str(r, &id) && cache_get_str(r, &user) && cache_get_byte(r, &open)))
+		return FALSE;
+	if (slack_object_hash_table_lookup(sa->ims, id))
+		return TRUE;
+
+	struct cache_object im;
+	cache_object_init(&im);
+	cache_prop_str(&im, "id", id);
+	cache_prop_str(&im, "user", user);
+	cache_prop_bool(&im, "is_open", open);
+	slack_im_set(sa, &im.obj, NULL, FALSE);
+	return TRUE;
+}
+
+gboolean slack_cache_load(SlackAccount *sa) {
+	char *file = cache_file(sa);
+	if (!file)
+		return FALSE;
+
+	gchar *data;
+	gsize len;
+	GError *err = NULL;
+	if (!g_file_get_contents(file, &data, &len, &err)) {
+		purple_debug_info("slack", "no cache: %s\n", err->message);
+		g_error_free(err);
+		g_free(file);
+		return FALSE;
+	}
+
+	struct cache_reader r = { data, data + len };
+	guint8 version = 0;
+	if (len < strlen(CACHE_MAGIC) || memcmp(data, CACHE_MAGIC, strlen(CACHE_MAGIC))
+			|| (r.p += strlen(CACHE_MAGIC), !cache_get_byte(&r, &version)) || version != CACHE_VERSION) {
+		purple_debug_warning("slack", "ignoring cache %s (version %u)\n", file, version);
+		g_free(data);
+		g_free(file);
+		return FALSE;
+	}
+
+	unsigned count = 0;
+	guint8 kind;
+	gboolean ok = TRUE;
+	while (ok && cache_get_byte(&r, &kind) && kind != CACHE_END) {
+		switch (kind) {
+			case CACHE_USER:
+				ok = cache_load_user(sa, &r);
+				break;
+			case CACHE_CHANNEL:
+				ok = cache_load_channel(sa, &r);
+				break;
+			case CACHE_IM:
+				ok = cache_load_im(sa, &r);
+				break;
+			default:
+				ok = FALSE;
+		}
+		count += ok;
+	}
+	if (!ok)
+		/* whatever we got is still useful, and will be reconciled anyway */
+		purple_debug_warning("slack", "cache %s truncated at offset %ld\n", file, (long)(r.p - data));
+
+	purple_debug_info("slack", "read %u objects from cache %s\n", count, file);
+	g_free(data);
+	g_free(file);
+	return count > 0;
+}
+
+void slack_cache_save(SlackAccount *sa) {
+	char *file = cache_file(sa);
+	if (!file)
+		return;
+
+	GString *buf = g_string_sized_new(64 * (g_hash_table_size(sa->users) + g_hash_table_size(sa->channels)));
+	g_string_append(buf, CACHE_MAGIC);
+	g_string_append_c(buf, CACHE_VERSION);
+
+	GHashTableIter iter;
+	SlackUser *user;
+	g_hash_table_iter_init(&iter, sa->users);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&user)) {
+		g_string_append_c(buf, CACHE_USER);
+		cache_put_str(buf, user->object.id);
+		cache_put_str(buf, user->object.name);
+		cache_put_str(buf, user->status);
+		cache_put_str(buf, user->avatar_hash);
+		cache_put_str(buf, user->avatar_url);
+	}
+
+	SlackChannel *chan;
+	g_hash_table_iter_init(&iter, sa->channels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&chan)) {
+		g_string_append_c(buf, CACHE_CHANNEL);
+		cache_put_str(buf, chan->object.id);
+		cache_put_str(buf, chan->object.name);
+		g_string_append_c(buf, chan->type);
+	}
+
+	g_hash_table_iter_init(&iter, sa->ims);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&user)) {
+		g_string_append_c(buf, CACHE_IM);
+		cache_put_str(buf, user->im);
+		cache_put_str(buf, user->object.id);
+		g_string_append_c(buf, user->object.buddy != NULL);
+	}
+
+	g_string_append_c(buf, CACHE_END);
+
+	char *dir = g_path_get_dirname(file);
+	if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+		purple_util_write_data_to_file_absolute(file, buf->str, buf->len);
+	else
+		purple_debug_error("slack", "could not create %s\n", dir);
+	g_free(dir);
+
+	g_string_free(buf, TRUE);
+	g_free(file);
+}
@@ -0,0 +1,16 @@
+#ifndef _PURPLE_SLACK_CACHE_H
+#define _PURPLE_SLACK_CACHE_H
+
+#include "slack.h"
+
+/**
+ * On-disk snapshot of users, channels, and ims (per team and user), so that we can sign on before the full lists are loaded.
+ */
+
+/* Restore the snapshot (without replacing anything already known), returning whether there was one */
+gboolean slack_cache_load(SlackAccount *sa);
+
+/* Write out the current users, channels, and ims */
+void slack_cache_save(SlackAccount *sa);
+
+#endif // _PURPLE_SLACK_CACHE_H
@@ -10,6 +10,7 @@
 #include "slack-user.h"
 #include "slack-conversation.h"
 #include "slack-channel.h"
+#include "slack-intern.h"
 
 G_DEFINE_TYPE(SlackChannel, slack_channel, SLACK_TYPE_OBJECT);
 
@@ -47,6 +48,13 @@ static void channel_depart(SlackAccount *sa, SlackChannel *chan) {
 	}
 }
 
+void slack_channel_remove(SlackAccount *sa, SlackChannel *chan) {
+	channel_depart(sa, chan);
+	if (chan->object.name)
+		g_hash_table_remove(sa->channel_names, chan->object.name);
+	g_hash_table_remove(sa->channels, chan->object.id);
+}
+
 SlackChannel *slack_channel_set(SlackAccount *sa, json_value *json, SlackChannelType type) {
 	const char *sid = json_get_strptr(json);
 	if (sid)
@@ -72,12 +80,8 @@ SlackChannel *slack_channel_set(SlackAccount *sa, json_value *json, SlackChannel
 		type = SLACK_CHANNEL_PUBLIC;
 
 	if (type == SLACK_CHANNEL_DELETED) {
-		if (!chan)
-			return NULL;
-		channel_depart(sa, chan);
-		if (chan->object.name)
-			g_hash_table_remove(sa->channel_names, chan->object.name);
-		g_hash_table_remove(sa->channels, id);
+		if (chan)
+			slack_channel_remove(sa, chan);
 		return NULL;
 	}
 
@@ -99,8 +103,7 @@ SlackChannel *slack_channel_set(SlackAccount *sa, json_value *json, SlackChannel
 		
 		if (chan->object.name)
 			g_hash_table_remove(sa->channel_names, chan->object.name);
-		g_free(chan->object.name);
-		chan->object.name = g_strdup(name);
+		slack_intern_set(&chan->object.name, name);
 		g_hash_table_insert(sa->channel_names, chan->object.name, chan);
 		if (chan->object.buddy)
 			g_hash_table_insert(channel_buddy(chan)->components, "name", g_strdup(chan->object.name));
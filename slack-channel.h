@@ -33,6 +33,8 @@ static inline PurpleChat *channel_buddy(SlackChannel *chan) {
 
 /* Initialization */
 SlackChannel *slack_channel_set(SlackAccount *sa, json_value *json, SlackChannelType type);
+/* Forget about a channel that no longer exists */
+void slack_channel_remove(SlackAccount *sa, SlackChannel *chan);
 
 /* Open a purple conversation for a channel */
 void slack_chat_open(SlackAccount *sa, SlackChannel *chan);
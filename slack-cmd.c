@@ -2,6 +2,7 @@
 
 #include "slack-json.h"
 #include "slack-api.h"
+#include "slack-rtm.h"
 #include "slack-message.h"
 #include "slack-conversation.h"
 #include "slack-cmd.h"
@@ -78,6 +79,18 @@ static PurpleCmdRet send_cmd(PurpleConversation *conv, const gchar *cmd, gchar *
 	return PURPLE_CMD_RET_OK;
 }
 
+static PurpleCmdRet stats_cmd(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar **error, void *data) {
+	SlackAccount *sa = get_slack_account(conv->account);
+	if (!sa)
+		return PURPLE_CMD_RET_FAILED;
+
+	GString *stats = slack_rtm_stats_format(sa, "<br>");
+	purple_conversation_write(conv, NULL, stats->len ? stats->str : "No RTM events yet", PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG, time(NULL));
+	g_string_free(stats, TRUE);
+
+	return PURPLE_CMD_RET_OK;
+}
+
 void slack_cmd_register() {
 	const char **cmdp = slack_cmds;
 	char cmdbuf[16] = "";
@@ -92,4 +105,8 @@ void slack_cmd_register() {
 				SLACK_PLUGIN_ID, send_cmd, cmd, NULL);
 		cmdp++;
 	}
+
+	/* handled locally */
+	purple_cmd_register("slackstats", "", PURPLE_CMD_P_PRPL, PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_PRPL_ONLY,
+			SLACK_PLUGIN_ID, stats_cmd, "slackstats:  Show RTM event counts, latencies, and memory use for this account", NULL);
 }
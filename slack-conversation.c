@@ -6,39 +6,84 @@
 #include "slack-im.h"
 #include "slack-message.h"
 #include "slack-conversation.h"
+#include "slack-intern.h"
 
-static SlackObject *conversation_update(SlackAccount *sa, json_value *json) {
-	if (json_get_prop_boolean(json, "is_im", FALSE))
+static void conversation_im_user_cb(SlackAccount *sa, gpointer data, SlackUser *user) {
+	json_value *json = data;
+	if (user)
+		slack_im_set(sa, json, &json_value_none, TRUE);
+	json_value_free(json);
+}
+
+/* retrieve_user: look up an unknown IM partner first (FALSE if that's already been tried) */
+static SlackObject *conversation_update(SlackAccount *sa, json_value *json, gboolean retrieve_user) {
+	if (json_get_prop_boolean(json, "is_im", FALSE)) {
+		const char *uid = json_get_prop_strptr(json, "user");
+		if (uid && retrieve_user && sa->lazy_users && !slack_object_hash_table_lookup(sa->users, uid)) {
+			/* we need to know who it's with first */
+			slack_user_retrieve(sa, uid, conversation_im_user_cb, slack_json_copy(json));
+			return NULL;
+		}
 		return (SlackObject*)slack_im_set(sa, json, &json_value_none, FALSE);
-	else
+	} else
 		return (SlackObject*)slack_channel_set(sa, json, SLACK_CHANNEL_UNKNOWN);
 }
 
-#define CONVERSATIONS_LIST_CALL(sa, ARGS...) \
-	slack_api_call(sa, conversations_list_cb, NULL, "conversations.list", "types", "public_channel,private_channel,mpim,im", "exclude_archived", "true", SLACK_PAGINATE_LIMIT, ##ARGS, NULL)
+static void conversations_list_channel(SlackAccount *sa, gpointer data, json_value *json) {
+	GHashTable *stale = data;
+	slack_object_hash_table_remove(stale, json_get_prop_strptr(json, "id"));
+	conversation_update(sa, json, TRUE);
+}
+
+#define CONVERSATIONS_LIST_CALL(sa, stale, ARGS...) \
+	slack_api_call_stream(sa, conversations_list_cb, "channels", conversations_list_channel, stale, "conversations.list", "types", "public_channel,private_channel,mpim,im", "exclude_archived", "true", SLACK_PAGINATE_LIMIT, ##ARGS, NULL)
 
 static void conversations_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	GHashTable *stale = data;
+	/* channels have already been passed to conversations_list_channel */
 	json_value *chans = json_get_prop_type(json, "channels", array);
 	if (!chans) {
+		g_hash_table_destroy(stale);
 		purple_connection_error_reason(sa->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing conversation list");
 		return;
 	}
 
-	for (unsigned i = 0; i < chans->u.array.length; i++)
-		conversation_update(sa, chans->u.array.values[i]);
-
 	char *cursor = json_get_prop_strptr(json_get_prop(json, "response_metadata"), "next_cursor");
-	if (cursor && *cursor)
-		CONVERSATIONS_LIST_CALL(sa, "cursor", cursor);
-	else
-		slack_login_step(sa);
+	if (cursor && *cursor) {
+		CONVERSATIONS_LIST_CALL(sa, stale, "cursor", cursor);
+		return;
+	}
+
+	/* whatever we knew before (from the cache) that wasn't listed is gone */
+	GHashTableIter iter;
+	gpointer id;
+	g_hash_table_iter_init(&iter, stale);
+	while (g_hash_table_iter_next(&iter, &id, NULL)) {
+		SlackChannel *chan = g_hash_table_lookup(sa->channels, id);
+		SlackUser *user;
+		if (chan)
+			slack_channel_remove(sa, chan);
+		else if ((user = g_hash_table_lookup(sa->ims, id)))
+			slack_im_remove(sa, user);
+	}
+	g_hash_table_destroy(stale);
+
+	slack_login_step(sa);
 }
 
 void slack_conversations_load(SlackAccount *sa) {
-	g_hash_table_remove_all(sa->channels);
-	g_hash_table_remove_all(sa->ims);
-	CONVERSATIONS_LIST_CALL(sa);
+	/* channel and im ids we already have, until they are listed */
+	GHashTable *stale = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, g_free, NULL);
+	GHashTable *known[] = { sa->channels, sa->ims };
+	GHashTableIter iter;
+	gpointer id;
+	for (unsigned i = 0; i < G_N_ELEMENTS(known); i++) {
+		g_hash_table_iter_init(&iter, known[i]);
+		while (g_hash_table_iter_next(&iter, &id, NULL))
+			g_hash_table_insert(stale, g_memdup(id, SLACK_OBJECT_ID_SIZ), NULL);
+	}
+	CONVERSATIONS_LIST_CALL(sa, stale);
 }
 
 SlackObject *slack_conversation_get_conversation(SlackAccount *sa, PurpleConversation *conv) {
@@ -60,7 +105,9 @@ struct conversation_retrieve {
 
 static void conversation_retrieve_user_cb(SlackAccount *sa, gpointer data, SlackUser *user) {
 	struct conversation_retrieve *lookup = data;
-	lookup->cb(sa, lookup->data, conversation_update(sa, lookup->json));
+	/* the user has been retrieved already, whether or not that worked */
+	lookup->cb(sa, lookup->data, conversation_update(sa, lookup->json, FALSE));
+	json_value_free(lookup->json);
 	g_free(lookup);
 }
 
@@ -73,10 +120,11 @@ static void conversation_retrieve_cb(SlackAccount *sa, gpointer data, json_value
 		g_free(lookup);
 		return;
 	}
-	lookup->json = chan;
-	if (json_get_prop_boolean(json, "is_im", FALSE)) {
+	/* the response goes away when we return, but the user lookup may not be inline */
+	lookup->json = slack_json_copy(chan);
+	if (json_get_prop_boolean(chan, "is_im", FALSE)) {
 		/* Make sure we know the user, too */
-		const char *uid = json_get_prop_strptr(json, "user");
+		const char *uid = json_get_prop_strptr(chan, "user");
 		if (uid)
 			return slack_user_retrieve(sa, uid, conversation_retrieve_user_cb, lookup);
 	}
@@ -104,8 +152,7 @@ static gboolean mark_conversation_timer(gpointer data) {
 		SlackObject *obj = next;
 		next = obj->mark_next;
 		obj->mark_next = NULL;
-		g_free(obj->last_mark);
-		obj->last_mark = g_strdup(obj->last_read);
+		slack_intern_set(&obj->last_mark, obj->last_read);
 		/* XXX conversations.mark call??? */
 		slack_api_channel_call(sa, NULL, NULL, obj, "mark", "ts", obj->last_mark, NULL);
 	}
@@ -125,8 +172,7 @@ void slack_mark_conversation(SlackAccount *sa, PurpleConversation *conv) {
 
 	if (slack_ts_cmp(obj->last_mesg, obj->last_mark) <= 0)
 		return; /* already marked newer */
-	g_free(obj->last_read);
-	obj->last_read = g_strdup(obj->last_mesg);
+	slack_intern_set(&obj->last_read, obj->last_mesg);
 
 	if (obj->mark_next)
 		return; /* already on list */
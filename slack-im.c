@@ -11,26 +11,94 @@
 #include "slack-channel.h"
 #include "slack-im.h"
 
-void slack_presence_sub(SlackAccount *sa) {
+/* presence_sub replaces the whole subscription, so changes to sa->presence_subs are sent together after a moment */
+#define PRESENCE_SUB_DELAY	500 /* ms */
+
+static gboolean presence_sub_send(gpointer data) {
+	SlackAccount *sa = data;
+	sa->presence_sub_timer = 0;
+	if (!sa->presence_subs_changed)
+		return FALSE;
+	sa->presence_subs_changed = FALSE;
+
+	/* changes may have cancelled out */
+	GHashTable *sent = sa->presence_subs_sent;
+	if (sent && g_hash_table_size(sent) == g_hash_table_size(sa->presence_subs)) {
+		GHashTableIter iter;
+		gpointer id;
+		gboolean same = TRUE;
+		g_hash_table_iter_init(&iter, sa->presence_subs);
+		while (same && g_hash_table_iter_next(&iter, &id, NULL))
+			same = g_hash_table_lookup(sent, id) != NULL;
+		if (same)
+			return FALSE;
+	}
+
+	if (sent)
+		g_hash_table_remove_all(sent);
+	else
+		sent = sa->presence_subs_sent = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, g_free, NULL);
+
 	GString *ids = g_string_new("[");
 	GHashTableIter iter;
 	gpointer id;
-	SlackUser *user;
-	g_hash_table_iter_init(&iter, sa->ims);
-	gboolean first = TRUE;
-	while (g_hash_table_iter_next(&iter, &id, (gpointer*)&user)) {
-		if (!user->object.buddy)
-			continue;
-		if (first)
-			first = FALSE;
-		else
+	g_hash_table_iter_init(&iter, sa->presence_subs);
+	while (g_hash_table_iter_next(&iter, &id, NULL)) {
+		if (ids->len > 1)
 			g_string_append_c(ids, ',');
-		append_json_string(ids, user->object.id);
+		append_json_string(ids, id);
+		gpointer copy = g_memdup(id, SLACK_OBJECT_ID_SIZ);
+		g_hash_table_insert(sent, copy, copy);
 	}
 	g_string_append_c(ids, ']');
 
 	slack_rtm_send(sa, NULL, NULL, "presence_sub", "ids", ids->str, NULL);
 	g_string_free(ids, TRUE);
+	return FALSE;
+}
+
+static void presence_sub_schedule(SlackAccount *sa) {
+	if (sa->presence_subs_changed && !sa->presence_sub_timer)
+		sa->presence_sub_timer = purple_timeout_add(PRESENCE_SUB_DELAY, presence_sub_send, sa);
+}
+
+/* Keep sa->presence_subs up to date with whether user has an IM buddy */
+static void presence_sub_set(SlackAccount *sa, SlackUser *user, gboolean sub) {
+	if (sub) {
+		if (g_hash_table_lookup(sa->presence_subs, user->object.id))
+			return;
+		gpointer id = g_memdup(user->object.id, SLACK_OBJECT_ID_SIZ);
+		g_hash_table_insert(sa->presence_subs, id, id);
+	} else if (!g_hash_table_remove(sa->presence_subs, user->object.id))
+		return;
+	sa->presence_subs_changed = TRUE;
+}
+
+void slack_presence_sub(SlackAccount *sa) {
+	/* a new connection has no subscription yet */
+	if (sa->presence_subs_sent) {
+		g_hash_table_destroy(sa->presence_subs_sent);
+		sa->presence_subs_sent = NULL;
+	}
+	sa->presence_subs_changed = TRUE;
+	presence_sub_schedule(sa);
+}
+
+static void im_depart(SlackAccount *sa, SlackUser *user) {
+	if (!user->object.buddy)
+		return;
+	slack_blist_uncache(sa, user->object.buddy);
+	purple_blist_remove_buddy(user_buddy(user));
+	user->object.buddy = NULL;
+}
+
+void slack_im_remove(SlackAccount *sa, SlackUser *user) {
+	purple_debug_misc("slack", "im %s: removed\n", user->im);
+	im_depart(sa, user);
+	/* sent along with the next presence_sub */
+	presence_sub_set(sa, user, FALSE);
+	g_hash_table_remove(sa->ims, user->im);
+	slack_object_id_clear(user->im);
 }
 
 SlackUser *slack_im_set(SlackAccount *sa, json_value *json, const json_value *open_user, gboolean update_sub) {
@@ -47,7 +115,6 @@ SlackUser *slack_im_set(SlackAccount *sa, json_value *json, const json_value *op
 	SlackUser *user = g_hash_table_lookup(sa->ims, id);
 
 	gboolean is_open = json_get_prop_boolean(json, "is_open", open_user != NULL);
-	gboolean changed = FALSE;
 
 	const char *user_id = json_get_prop_strptr(json, "user") ?: json_get_strptr(open_user);
 	g_return_val_if_fail(user_id, user);
@@ -63,7 +130,6 @@ SlackUser *slack_im_set(SlackAccount *sa, json_value *json, const json_value *op
 				g_hash_table_remove(sa->ims, user->im);
 			slack_object_id_copy(user->im, id);
 			g_hash_table_insert(sa->ims, user->im, user);
-			changed = TRUE;
 		}
 	} else
 		g_warn_if_fail(slack_object_id_is(user->object.id, user_id));
@@ -72,29 +138,24 @@ SlackUser *slack_im_set(SlackAccount *sa, json_value *json, const json_value *op
 		if (!user->object.buddy) {
 			user->object.buddy = g_hash_table_lookup(sa->buddies, sid);
 			if (user->object.buddy && PURPLE_BLIST_NODE_IS_BUDDY(user->object.buddy)) {
-				if (user->object.name && strcmp(user->object.name, purple_buddy_get_name(user_buddy(user)))) {
+				if (user->object.name && strcmp(user->object.name, purple_buddy_get_name(user_buddy(user))))
 					purple_blist_rename_buddy(user_buddy(user), user->object.name);
-					changed = TRUE;
-				}
 			} else {
 				user->object.buddy = PURPLE_BLIST_NODE(purple_buddy_new(sa->account, user->object.name, NULL));
 				slack_blist_cache(sa, user->object.buddy, sid);
 				purple_blist_add_buddy(user_buddy(user), NULL, sa->blist, NULL);
-				changed = TRUE;
 			}
 		}
 
 		slack_update_avatar(sa, user);
-	} else if (user->object.buddy) {
-		slack_blist_uncache(sa, user->object.buddy);
-		purple_blist_remove_buddy(user_buddy(user));
-		user->object.buddy = NULL;
-	}
+	} else
+		im_depart(sa, user);
 
 	purple_debug_misc("slack", "im %s: %s\n", user->im, user->object.id);
 
-	if (changed && update_sub)
-		slack_presence_sub(sa);
+	presence_sub_set(sa, user, user->object.buddy != NULL);
+	if (update_sub)
+		presence_sub_schedule(sa);
 	return user;
 }
 
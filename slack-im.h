@@ -6,8 +6,11 @@
 #include "slack-user.h"
 
 /* Initialization */
+/* (Re)send the presence subscription for users with IM buddies, shortly */
 void slack_presence_sub(SlackAccount *sa);
 SlackUser *slack_im_set(SlackAccount *sa, json_value *json, const json_value *open_user, gboolean update_sub);
+/* Forget the user's IM (and its buddy), as if it had never been listed */
+void slack_im_remove(SlackAccount *sa, SlackUser *user);
 
 /* RTM event handlers */
 void slack_im_close(SlackAccount *sa, json_value *json);
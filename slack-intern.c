@@ -0,0 +1,125 @@
+#include "slack-user.h"
+#include "slack-channel.h"
+#include "slack-intern.h"
+
+/* Each string lives in a single slice (so there is no per-block malloc header) after its reference count */
+struct intern {
+	guint32 ref;
+	guint32 len;
+	char str[];
+};
+
+#define INTERN(s)		((struct intern *)((s) - G_STRUCT_OFFSET(struct intern, str)))
+#define INTERN_SIZE(len)	(G_STRUCT_OFFSET(struct intern, str) + (len) + 1)
+
+/* str -> str, shared by all accounts, and freed once empty */
+static GHashTable *intern_table;
+static gsize intern_bytes;
+
+char *slack_intern(const char *s) {
+	if (!s)
+		return NULL;
+	if (!intern_table)
+		intern_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	char *p = g_hash_table_lookup(intern_table, s);
+	if (p) {
+		INTERN(p)->ref++;
+		return p;
+	}
+
+	size_t len = strlen(s);
+	struct intern *in = g_slice_alloc(INTERN_SIZE(len));
+	in->ref = 1;
+	in->len = len;
+	memcpy(in->str, s, len + 1);
+	g_hash_table_insert(intern_table, in->str, in->str);
+	intern_bytes += INTERN_SIZE(len);
+	return in->str;
+}
+
+void slack_intern_unref(char *s) {
+	if (!s)
+		return;
+	struct intern *in = INTERN(s);
+	g_return_if_fail(in->ref > 0);
+	if (--in->ref)
+		return;
+
+	g_hash_table_remove(intern_table, s);
+	intern_bytes -= INTERN_SIZE(in->len);
+	g_slice_free1(INTERN_SIZE(in->len), in);
+	if (!g_hash_table_size(intern_table)) {
+		g_hash_table_destroy(intern_table);
+		intern_table = NULL;
+	}
+}
+
+void slack_intern_set(char **field, const char *s) {
+	if (!g_strcmp0(*field, s))
+		return;
+	char *old = *field;
+	*field = slack_intern(s);
+	slack_intern_unref(old);
+}
+
+/* These are only estimates: glibc's chunk size for a malloc of n bytes, and a hash table entry (key, value, hash) */
+#define MALLOC_SIZE(n)	MAX(32, ((n) + 8 + 15) & ~(gsize)15)
+#define ENTRY_SIZE	(2*sizeof(gpointer) + sizeof(guint))
+
+struct intern_usage {
+	unsigned count;
+	gsize shared; /* our part of each interned string */
+	gsize unshared; /* as a separate g_strdup of each */
+};
+
+static void intern_usage_add(struct intern_usage *u, const char *s) {
+	if (!s)
+		return;
+	struct intern *in = INTERN(s);
+	u->shared += (INTERN_SIZE(in->len) + ENTRY_SIZE) / in->ref;
+	u->unshared += MALLOC_SIZE(in->len + 1);
+}
+
+static void object_usage_add(struct intern_usage *u, SlackObject *obj) {
+	u->count++;
+	intern_usage_add(u, obj->name);
+	intern_usage_add(u, obj->last_mesg);
+	intern_usage_add(u, obj->last_read);
+	intern_usage_add(u, obj->last_mark);
+}
+
+static void intern_usage_format(GString *str, const char *what, struct intern_usage *u, gsize size) {
+	unsigned n = MAX(u->count, 1);
+	g_string_append_printf(str, "%s: %u, %zu bytes each + %zu bytes of strings (%zu unshared)",
+			what, u->count, size, u->shared / n, u->unshared / n);
+}
+
+void slack_intern_stats_format(SlackAccount *sa, GString *str, const char *eol) {
+	GHashTableIter iter;
+	gpointer obj;
+
+	struct intern_usage users = { 0 };
+	g_hash_table_iter_init(&iter, sa->users);
+	while (g_hash_table_iter_next(&iter, NULL, &obj)) {
+		SlackUser *user = obj;
+		object_usage_add(&users, &user->object);
+		intern_usage_add(&users, user->status);
+		intern_usage_add(&users, user->avatar_hash);
+		intern_usage_add(&users, user->avatar_url);
+	}
+
+	struct intern_usage chans = { 0 };
+	g_hash_table_iter_init(&iter, sa->channels);
+	while (g_hash_table_iter_next(&iter, NULL, &obj))
+		object_usage_add(&chans, obj);
+
+	if (str->len)
+		g_string_append(str, eol);
+	intern_usage_format(str, "(users)", &users, sizeof(SlackUser));
+	g_string_append(str, eol);
+	intern_usage_format(str, "(channels)", &chans, sizeof(SlackChannel));
+	g_string_append(str, eol);
+	g_string_append_printf(str, "(interned): %u strings, %zu bytes (all accounts)",
+			intern_table ? g_hash_table_size(intern_table) : 0, intern_bytes);
+}
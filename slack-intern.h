@@ -0,0 +1,21 @@
+#ifndef _PURPLE_SLACK_INTERN_H
+#define _PURPLE_SLACK_INTERN_H
+
+#include "slack.h"
+
+/**
+ * Shared, reference counted copies of strings held by many objects (names, statuses, avatars, ts marks).
+ * Interned strings must not be modified, and are released with slack_intern_unref rather than g_free.
+ */
+
+/* A new reference to the interned copy of s (or NULL) */
+char *slack_intern(const char *s);
+/* Drop a reference from slack_intern (NULL is ignored) */
+void slack_intern_unref(char *s);
+/* Replace the interned string in *field with (an interned copy of) s, if different */
+void slack_intern_set(char **field, const char *s);
+
+/* Describe the string memory used by sa's users and channels, compared to separate copies */
+void slack_intern_stats_format(SlackAccount *sa, GString *str, const char *eol);
+
+#endif // _PURPLE_SLACK_INTERN_H
@@ -1,12 +1,97 @@
 #include <string.h>
 
+#include "purple-debug.h"
+
 #include "slack-json.h"
 
+/* objects with at least this many properties get a hash index on first lookup */
+#define JSON_INDEX_MIN	8
+
+struct json_index {
+	unsigned int mask;
+	unsigned int slot[]; /* entry index+1, or 0 for empty */
+};
+
+/* Stored in the json_settings.value_extra space after every value we create (parsed or copied) */
+struct json_extra {
+	SlackJSONArena *arena; /* only on the root of a document parsed into an arena */
+	struct json_index *index; /* objects only, allocated in arena */
+};
+
+#define json_extra(VAL) ((struct json_extra *)((json_value *)(VAL) + 1))
+
+/* The roots of our documents point _reserved (unused once parsed) at their extra space, to tell them apart from others' */
+static inline void json_extra_mark(json_value *root) {
+	root->_reserved.object_mem = json_extra(root);
+}
+
+/* NULL if val isn't part of one of our documents, and so has no extra space */
+static struct json_extra *json_extra_get(json_value *val) {
+	json_value *root = val;
+	while (root->parent)
+		root = root->parent;
+	if (root->_reserved.object_mem != json_extra(root))
+		return NULL;
+	return json_extra(val);
+}
+
+static void *arena_alloc(size_t size, int zero, void *user_data);
+
+static inline unsigned int json_prop_hash(const char *s) {
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static struct json_index *json_index_build(json_value *val) {
+	json_value *root = val;
+	while (root->parent)
+		root = root->parent;
+	SlackJSONArena *arena = json_extra(root)->arena;
+	if (!arena)
+		/* copies don't have anywhere to keep an index */
+		return NULL;
+
+	unsigned int n = val->u.object.length;
+	unsigned int size = 2*JSON_INDEX_MIN;
+	while (size < 2*n)
+		size *= 2;
+	struct json_index *index = arena_alloc(sizeof(struct json_index) + size * sizeof(*index->slot), 1, arena);
+	index->mask = size-1;
+
+	/* insert backwards so that on duplicate keys the first one wins, like the linear search */
+	for (unsigned int i = n; i; i--) {
+		unsigned int h = json_prop_hash(val->u.object.values[i-1].name) & index->mask;
+		while (index->slot[h] && strcmp(val->u.object.values[index->slot[h]-1].name, val->u.object.values[i-1].name))
+			h = (h+1) & index->mask;
+		index->slot[h] = i;
+	}
+
+	return json_extra(val)->index = index;
+}
+
 json_value *json_get_prop(json_value *val, const char *index) {
 	if (!val || val->type != json_object) {
 		return NULL;
 	}
 
+	struct json_extra *extra;
+	if (val->u.object.length >= JSON_INDEX_MIN && (extra = json_extra_get(val))) {
+		struct json_index *idx = extra->index ?: json_index_build(val);
+		if (idx) {
+			unsigned int h = json_prop_hash(index) & idx->mask;
+			unsigned int i;
+			while ((i = idx->slot[h])) {
+				if (!strcmp(val->u.object.values[i-1].name, index))
+					return val->u.object.values[i-1].value;
+				h = (h+1) & idx->mask;
+			}
+			return NULL;
+		}
+	}
+
 	for (unsigned int i = 0; i < val->u.object.length; ++ i) {
 		if (!strcmp (val->u.object.values[i].name, index)) {
 			return val->u.object.values[i].value;
@@ -16,6 +101,316 @@ json_value *json_get_prop(json_value *val, const char *index) {
 	return NULL;
 }
 
+/* initial (and minimum retained) block size */
+#define ARENA_BLOCK_SIZE	(64*1024)
+/* don't hold on to more than this between documents */
+#define ARENA_RETAIN_SIZE	(1024*1024)
+#define ARENA_ALIGN(n)	(((n) + 2*sizeof(void*)-1) & ~(2*sizeof(void*)-1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	char data[];
+};
+
+struct _SlackJSONArena {
+	struct arena_block *block; /* current block, followed by older (smaller) ones */
+	json_settings settings;
+};
+
+static struct arena_block *arena_block_new(size_t size) {
+	struct arena_block *b = g_malloc(sizeof(struct arena_block) + size);
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static void *arena_alloc(size_t size, int zero, void *user_data) {
+	SlackJSONArena *arena = user_data;
+	struct arena_block *b = arena->block;
+	size = ARENA_ALIGN(size);
+
+	if (b->size - b->used < size) {
+		/* grow geometrically, so a large document ends up in a few blocks */
+		size_t bsize = b->size * 2;
+		while (bsize < size)
+			bsize *= 2;
+		b = arena_block_new(bsize);
+		b->next = arena->block;
+		arena->block = b;
+	}
+
+	void *p = &b->data[b->used];
+	b->used += size;
+	if (zero)
+		memset(p, 0, size);
+	return p;
+}
+
+static void arena_free(void *p, void *user_data) {
+	/* everything is released by slack_json_arena_reset */
+}
+
+SlackJSONArena *slack_json_arena_new(void) {
+	SlackJSONArena *arena = g_new0(SlackJSONArena, 1);
+	arena->block = arena_block_new(ARENA_BLOCK_SIZE);
+	arena->settings.mem_alloc = arena_alloc;
+	arena->settings.mem_free = arena_free;
+	arena->settings.user_data = arena;
+	arena->settings.value_extra = sizeof(struct json_extra);
+	return arena;
+}
+
+void slack_json_arena_reset(SlackJSONArena *arena) {
+	struct arena_block *b = arena->block;
+
+	/* keep only the newest (largest) block, unless it's excessive */
+	if (b->size > ARENA_RETAIN_SIZE) {
+		arena->block = arena_block_new(ARENA_RETAIN_SIZE);
+		arena->block->next = b;
+	} else
+		b->used = 0;
+
+	b = arena->block->next;
+	arena->block->next = NULL;
+	while (b) {
+		struct arena_block *next = b->next;
+		g_free(b);
+		b = next;
+	}
+}
+
+void slack_json_arena_free(SlackJSONArena *arena) {
+	if (!arena)
+		return;
+	struct arena_block *b = arena->block;
+	while (b) {
+		struct arena_block *next = b->next;
+		g_free(b);
+		b = next;
+	}
+	g_free(arena);
+}
+
+json_value *slack_json_arena_parse(SlackJSONArena *arena, const char *buf, size_t len) {
+	json_value *json = json_parse_ex(&arena->settings, buf, len, NULL);
+	if (json) {
+		json_extra(json)->arena = arena;
+		json_extra_mark(json);
+	}
+	return json;
+}
+
+/* Find the end of the json value starting at p (not validated: that's left for json_parse) */
+static const char *json_skip_value(const char *p, const char *end) {
+	unsigned depth = 0;
+	while (p < end) {
+		switch (*p++) {
+			case '"':
+				while (p < end && *p != '"')
+					p += *p == '\\' ? 2 : 1;
+				if (p++ >= end)
+					return NULL;
+				if (!depth)
+					return p;
+				break;
+			case '[':
+			case '{':
+				depth++;
+				break;
+			case ']':
+			case '}':
+				if (!depth--)
+					return NULL;
+				if (!depth)
+					return p;
+				break;
+			case ',':
+			case ':':
+				if (!depth)
+					return p-1;
+				break;
+			case ' ': case '\t': case '\r': case '\n':
+				break;
+			default:
+				/* scalar */
+				if (!depth) {
+					while (p < end && !strchr(",]} \t\r\n", *p))
+						p++;
+					return p;
+				}
+		}
+	}
+	return NULL;
+}
+
+static const char *json_skip_space(const char *p, const char *end) {
+	while (p < end && g_ascii_isspace(*p))
+		p++;
+	return p;
+}
+
+/* Find the array value of the top-level property prop, setting [*start,*stop) to its contents */
+static gboolean json_find_array(const char *p, const char *end, const char *prop, const char **start, const char **stop) {
+	size_t plen = strlen(prop);
+	p = json_skip_space(p, end);
+	if (p >= end || *p++ != '{')
+		return FALSE;
+	for (;;) {
+		p = json_skip_space(p, end);
+		if (p >= end || *p != '"')
+			return FALSE;
+		const char *key = p+1;
+		if (!(p = json_skip_value(p, end)))
+			return FALSE;
+		gboolean match = p-1-key == plen && !memcmp(key, prop, plen);
+		p = json_skip_space(p, end);
+		if (p >= end || *p++ != ':')
+			return FALSE;
+		p = json_skip_space(p, end);
+		const char *val = p;
+		if (!(p = json_skip_value(p, end)))
+			return FALSE;
+		if (match && *val == '[') {
+			*start = val+1;
+			*stop = p-1;
+			return TRUE;
+		}
+		p = json_skip_space(p, end);
+		if (p >= end || *p++ != ',')
+			return FALSE;
+	}
+}
+
+/* Build any indexes the document will need now, as allocations made during streaming are rewound */
+static void json_index_all(json_value *val) {
+	unsigned int i;
+	switch (val->type) {
+		case json_object:
+			if (val->u.object.length >= JSON_INDEX_MIN && !json_extra(val)->index)
+				json_index_build(val);
+			for (i = 0; i < val->u.object.length; i++)
+				json_index_all(val->u.object.values[i].value);
+			break;
+		case json_array:
+			for (i = 0; i < val->u.array.length; i++)
+				json_index_all(val->u.array.values[i]);
+			break;
+		default:
+			break;
+	}
+}
+
+json_value *slack_json_arena_parse_stream(SlackJSONArena *arena, const char *buf, size_t len, const char *prop, SlackJSONStream *stream) {
+	const char *start, *stop;
+	stream->arena = arena;
+	stream->p = stream->end = NULL;
+
+	if (!json_find_array(buf, buf+len, prop, &start, &stop))
+		/* just parse the whole thing, and let the caller find out */
+		return slack_json_arena_parse(arena, buf, len);
+
+	/* the document without the elements is small, so just copy it */
+	size_t pre = start-buf, post = buf+len-stop;
+	char *rest = g_malloc(pre+post);
+	memcpy(rest, buf, pre);
+	memcpy(rest+pre, stop, post);
+	json_value *json = slack_json_arena_parse(arena, rest, pre+post);
+	g_free(rest);
+
+	if (json) {
+		json_index_all(json);
+		stream->p = start;
+		stream->end = stop;
+		stream->mark_block = arena->block;
+		stream->mark_used = arena->block->used;
+	}
+	return json;
+}
+
+json_value *slack_json_stream_next(SlackJSONStream *stream) {
+	SlackJSONArena *arena = stream->arena;
+	if (!stream->p)
+		return NULL;
+
+	/* discard the previous element (and anything else allocated since, which is why the document was indexed up front) */
+	while (arena->block != stream->mark_block) {
+		struct arena_block *b = arena->block;
+		arena->block = b->next;
+		g_free(b);
+	}
+	arena->block->used = stream->mark_used;
+
+	json_value *json = NULL;
+	while (!json) {
+		const char *p = json_skip_space(stream->p, stream->end);
+		if (p < stream->end && *p == ',')
+			p = json_skip_space(p+1, stream->end);
+		const char *e = p < stream->end ? json_skip_value(p, stream->end) : NULL;
+		if (!e) {
+			stream->p = NULL;
+			return NULL;
+		}
+		stream->p = e;
+		if (!(json = slack_json_arena_parse(arena, p, e-p)))
+			purple_debug_warning("slack", "Invalid JSON array element: %.*s\n", slack_debug_payload_len(e-p), p);
+	}
+	return json;
+}
+
+/* This has to match what json_value_free expects, so uses plain malloc like json.c */
+json_value *slack_json_copy(const json_value *val) {
+	if (!val)
+		return NULL;
+
+	json_value *copy = malloc(sizeof(json_value) + sizeof(struct json_extra));
+	memcpy(copy, val, sizeof(json_value));
+	memset(json_extra(copy), 0, sizeof(struct json_extra));
+	copy->parent = NULL;
+	json_extra_mark(copy);
+
+	unsigned int i;
+	switch (val->type) {
+		case json_string:
+			copy->u.string.ptr = malloc(val->u.string.length + 1);
+			memcpy(copy->u.string.ptr, val->u.string.ptr, val->u.string.length + 1);
+			break;
+
+		case json_array:
+			copy->u.array.values = val->u.array.length ? malloc(val->u.array.length * sizeof(json_value *)) : NULL;
+			for (i = 0; i < val->u.array.length; i++) {
+				copy->u.array.values[i] = slack_json_copy(val->u.array.values[i]);
+				copy->u.array.values[i]->parent = copy;
+			}
+			break;
+
+		case json_object: {
+			/* names are stored in the same block, after the entries */
+			size_t size = val->u.object.length * sizeof(json_object_entry);
+			for (i = 0; i < val->u.object.length; i++)
+				size += val->u.object.values[i].name_length + 1;
+			copy->u.object.values = val->u.object.length ? malloc(size) : NULL;
+			char *name = (char *)&copy->u.object.values[val->u.object.length];
+			for (i = 0; i < val->u.object.length; i++) {
+				json_object_entry *e = &copy->u.object.values[i];
+				e->name = name;
+				e->name_length = val->u.object.values[i].name_length;
+				memcpy(name, val->u.object.values[i].name, e->name_length + 1);
+				name += e->name_length + 1;
+				e->value = slack_json_copy(val->u.object.values[i].value);
+				e->value->parent = copy;
+			}
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	return copy;
+}
+
 GString *append_json_string(GString *str, const char *s) {
 	g_string_append_c(str, '"');
 	const char *p = s;
@@ -21,7 +21,8 @@
 #define json_get_boolean(JSON, DEF) \
 	json_get_val(JSON, boolean, DEF)
 
-json_value *json_get_prop(json_value *val, const char *prop) __attribute__((pure));
+/* Large objects from slack_json_arena_parse are indexed on first lookup; any others (copies, hand-built values) are searched linearly */
+json_value *json_get_prop(json_value *val, const char *prop);
 
 #define json_get_prop_type(JSON, PROP, TYPE) \
 	json_get_type(json_get_prop(JSON, PROP), TYPE)
@@ -34,6 +35,39 @@ json_value *json_get_prop(json_value *val, const char *prop) __attribute__((pure
 #define json_get_prop_boolean(JSON, PROP, DEF) \
 	json_get_boolean(json_get_prop(JSON, PROP), DEF)
 
+/**
+ * Bump allocator for parsed json documents.
+ * Every allocation made while parsing comes out of a few large blocks, and the whole document is released at once by resetting the arena.
+ */
+typedef struct _SlackJSONArena SlackJSONArena;
+
+SlackJSONArena *slack_json_arena_new(void);
+void slack_json_arena_free(SlackJSONArena *arena);
+/* Release everything parsed into the arena, keeping (some of) its memory for reuse */
+void slack_json_arena_reset(SlackJSONArena *arena);
+/* Parse a document into the arena: it is valid until the next reset, and must not be passed to json_value_free */
+json_value *slack_json_arena_parse(SlackJSONArena *arena, const char *buf, size_t len);
+
+/**
+ * Streaming parse of a large array property.
+ * slack_json_arena_parse_stream parses a document of the form {..., "prop": [elem, ...], ...} without prop's elements (leaving it an empty array),
+ * and sets up stream so that slack_json_stream_next can parse the elements one at a time.
+ * Each element is only valid until the next call, and nothing else may be parsed into the arena in between.
+ * The rest of the document stays valid throughout: it is fully indexed up front, so lookups on it allocate nothing.
+ */
+typedef struct _SlackJSONStream {
+	SlackJSONArena *arena;
+	const char *p, *end; /* remaining elements */
+	struct arena_block *mark_block;
+	size_t mark_used;
+} SlackJSONStream;
+
+json_value *slack_json_arena_parse_stream(SlackJSONArena *arena, const char *buf, size_t len, const char *prop, SlackJSONStream *stream);
+json_value *slack_json_stream_next(SlackJSONStream *stream);
+
+/* Make a standalone (malloc'd) copy of a json value, to be freed with json_value_free */
+json_value *slack_json_copy(const json_value *val);
+
 /* Add an escaped, quoted json string to a GString */
 GString *append_json_string(GString *str, const char *s);
 
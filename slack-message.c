@@ -8,6 +8,7 @@
 #include "slack-channel.h"
 #include "slack-conversation.h"
 #include "slack-message.h"
+#include "slack-intern.h"
 
 gchar *slack_html_to_message(SlackAccount *sa, const char *s, PurpleMessageFlags flags) {
 
@@ -72,19 +73,36 @@ gchar *slack_html_to_message(SlackAccount *sa, const char *s, PurpleMessageFlags
 	return g_string_free(msg, FALSE);
 }
 
-void slack_message_to_html(GString *html, SlackAccount *sa, gchar *s, PurpleMessageFlags *flags, gchar *prepend_newline_str) {
+/* Look up an object by an id that is not NUL terminated */
+static SlackObject *object_lookup_span(GHashTable *table, const char *s, size_t len) {
+	if (len >= SLACK_OBJECT_ID_SIZ)
+		return NULL;
+	slack_object_id id;
+	slack_object_id_clear(id);
+	memcpy(id, s, len);
+	return g_hash_table_lookup(table, id);
+}
+
+#define SPAN_IS(s, len, lit) ((len) == sizeof(lit)-1 && !memcmp(s, lit, sizeof(lit)-1))
+
+void slack_message_to_html(GString *html, SlackAccount *sa, const gchar *s, PurpleMessageFlags *flags, const gchar *prepend_newline_str) {
 	if (!s)
 		return;
 
 	if (flags)
 		*flags |= PURPLE_MESSAGE_NO_LINKIFY;
 
-	size_t l = strlen(s);
-	char *end = &s[l];
+	const char *end = s + strlen(s);
 
 	while (s < end) {
-		char c = *s++;
-		if (c == '\n') {
+		/* plain text (already escaped by slack) is copied through a run at a time */
+		size_t run = strcspn(s, "<\n");
+		g_string_append_len(html, s, run);
+		s += run;
+		if (s == end)
+			break;
+
+		if (*s++ == '\n') {
 			g_string_append(html, "<BR>");
 			
 			// This is here for attachments.  If this message is part of an attachment,
@@ -94,73 +112,68 @@ void slack_message_to_html(GString *html, SlackAccount *sa, gchar *s, PurpleMess
 			}
 			continue;
 		}
-		if (c != '<') {
-			g_string_append_c(html, c);
-			continue;
-		}
 
-		/* found a <tag> */
-		char *r = memchr(s, '>', end-s);
+		/* found a <tag>: <s|b> or <s> */
+		const char *r = memchr(s, '>', end-s);
 		if (!r)
 			/* should really be error */
 			r = end;
-		else
-			*r = 0;
-		char *b = memchr(s, '|', r-s);
+		const char *b = memchr(s, '|', r-s);
+		size_t len = (b ?: r) - s, blen = 0;
 		if (b) {
-			*b = 0;
 			b++;
+			blen = r - b;
 		}
 		switch (*s) {
 			case '#':
-				s++;
+				s++, len--;
 				g_string_append_c(html, '#');
 				if (!b) {
-					SlackChannel *chan = (SlackChannel*)slack_object_hash_table_lookup(sa->channels, s);
-					if (chan)
-						b = chan->object.name;
+					SlackChannel *chan = (SlackChannel*)object_lookup_span(sa->channels, s, len);
+					if (chan && (b = chan->object.name))
+						blen = strlen(b);
 				}
-				g_string_append(html, b ?: s);
+				g_string_append_len(html, b ?: s, b ? blen : len);
 				break;
 			case '@':
-				s++;
+				s++, len--;
 				g_string_append_c(html, '@');
 				SlackUser *user = NULL;
-				if (slack_object_id_is(sa->self->object.id, s)) {
+				if (len < SLACK_OBJECT_ID_SIZ && !sa->self->object.id[len] && !memcmp(sa->self->object.id, s, len)) {
 					user = sa->self;
 					if (flags)
 						*flags |= PURPLE_MESSAGE_NICK;
 				}
 				if (!b) {
 					if (!user)
-						user = (SlackUser*)slack_object_hash_table_lookup(sa->users, s);
-					if (user)
-						b = user->object.name;
+						user = (SlackUser*)object_lookup_span(sa->users, s, len);
+					if (user && (b = user->object.name))
+						blen = strlen(b);
 				}
-				g_string_append(html, b ?: s);
+				g_string_append_len(html, b ?: s, b ? blen : len);
 				break;
 			case '!':
-				s++;
-				if (!strcmp(s, "channel") || !strcmp(s, "group") || !strcmp(s, "here") || !strcmp(s, "everyone")) {
+				s++, len--;
+				if (SPAN_IS(s, len, "channel") || SPAN_IS(s, len, "group") || SPAN_IS(s, len, "here") || SPAN_IS(s, len, "everyone")) {
 					if (flags)
 						*flags |= PURPLE_MESSAGE_NICK;
 					g_string_append_c(html, '@');
-					g_string_append(html, b ?: s);
+					g_string_append_len(html, b ?: s, b ? blen : len);
 				} else {
 					g_string_append(html, "&lt;");
-					g_string_append(html, b ?: s);
+					g_string_append_len(html, b ?: s, b ? blen : len);
 					g_string_append(html, "&gt;");
 				}
 				break;
 			default:
 				/* URL */
 				g_string_append(html, "<A HREF=\"");
-				g_string_append(html, s); /* XXX embedded quotes? */
+				g_string_append_len(html, s, len); /* XXX embedded quotes? */
 				g_string_append(html, "\">");
-				g_string_append(html, b ?: s);
+				g_string_append_len(html, b ?: s, b ? blen : len);
 				g_string_append(html, "</A>");
 		}
-		s = r+1;
+		s = r < end ? r+1 : end;
 	}
 }
 
@@ -356,6 +369,8 @@ void slack_json_to_html(GString *html, SlackAccount *sa, json_value *message, Pu
 			slack_attachment_to_html(html, sa, attachments->u.array.values[i]);
 }
 
+static void typing_stop(SlackAccount *sa, SlackChannel *chan, SlackUser *user);
+
 void slack_handle_message(SlackAccount *sa, SlackObject *obj, json_value *json, PurpleMessageFlags flags) {
 	if (!obj) {
 		purple_debug_warning("slack", "Message to unknown channel %s\n", json_get_prop_strptr(json, "channel"));
@@ -439,6 +454,8 @@ void slack_handle_message(SlackAccount *sa, SlackObject *obj, json_value *json,
 					!strcmp(subtype, "group_topic"))
 				purple_conv_chat_set_topic(chat, user ? user->object.name : user_id, json_get_prop_strptr(json, "topic"));
 		}
+		if (user)
+			typing_stop(sa, chan, user);
 		
 		serv_got_chat_in(sa->gc, chan->cid, user ? user->object.name : user_id ?: username ?: "", flags, html->str, mt);
 	} else if (SLACK_IS_USER(obj)) {
@@ -462,20 +479,227 @@ void slack_handle_message(SlackAccount *sa, SlackObject *obj, json_value *json,
 	/* update most recent ts for later marking */
 	const char *tss = json_get_strptr(ts);
 	if (slack_ts_cmp(tss, obj->last_mesg) > 0) {
-		g_free(obj->last_mesg);
-		obj->last_mesg = g_strdup(tss);
+		slack_intern_set(&obj->last_mesg, tss);
+	}
+}
+
+/* Messages to a conversation waiting on lookups (of the conversation or senders), in ts order */
+struct pending_messages {
+	slack_object_id id;
+	SlackObject *obj; /* (ref) once known */
+	unsigned waiting; /* outstanding lookups */
+	GQueue messages; /* json_value copies */
+};
+
+static void pending_messages_done(SlackAccount *sa, struct pending_messages *pending) {
+	if (--pending->waiting)
+		return;
+	if (sa->pending_messages)
+		g_hash_table_steal(sa->pending_messages, pending->id);
+
+	json_value *json;
+	while ((json = g_queue_pop_head(&pending->messages))) {
+		slack_handle_message(sa, pending->obj, json, PURPLE_MESSAGE_RECV);
+		json_value_free(json);
+	}
+	if (pending->obj)
+		g_object_unref(pending->obj);
+	g_free(pending);
+}
+
+static void pending_conversation_cb(SlackAccount *sa, gpointer data, SlackObject *obj) {
+	struct pending_messages *pending = data;
+	if (obj)
+		pending->obj = g_object_ref(obj);
+	pending_messages_done(sa, pending);
+}
+
+static void pending_user_cb(SlackAccount *sa, gpointer data, SlackUser *user) {
+	pending_messages_done(sa, data);
+}
+
+void slack_pending_messages_abort(SlackAccount *sa) {
+	GHashTableIter iter;
+	gpointer pending;
+	g_hash_table_iter_init(&iter, sa->pending_messages);
+	while (g_hash_table_iter_next(&iter, NULL, &pending)) {
+		json_value *json;
+		while ((json = g_queue_pop_head(&((struct pending_messages *)pending)->messages)))
+			json_value_free(json);
+	}
+	/* each is freed once its lookups are called back, with nothing left to display */
+	g_hash_table_destroy(sa->pending_messages);
+	sa->pending_messages = NULL;
+}
+
+/* With lazy_users, the sender we need to look up before displaying, if any */
+static const char *message_unknown_user(SlackAccount *sa, json_value *json) {
+	const char *uid = json_get_prop_strptr(json, "user");
+	if (!uid || !sa->lazy_users)
+		return NULL;
+	return slack_object_hash_table_lookup(sa->users, uid) ? NULL : uid;
+}
+
+void slack_message(SlackAccount *sa, json_value *json) {
+	const char *channel = json_get_prop_strptr(json, "channel");
+	slack_object_id id;
+	slack_object_id_set(id, channel);
+	const char *uid = message_unknown_user(sa, json);
+
+	struct pending_messages *pending = g_hash_table_lookup(sa->pending_messages, id);
+	if (!pending) {
+		SlackObject *obj = slack_conversation_lookup_id(sa, id);
+		if (!channel || (obj && !uid))
+			return slack_handle_message(sa, obj, json, PURPLE_MESSAGE_RECV);
+
+		/* json only lives for this RTM message, so keep a copy until we're ready */
+		pending = g_new0(struct pending_messages, 1);
+		slack_object_id_copy(pending->id, id);
+		g_hash_table_insert(sa->pending_messages, pending->id, pending);
+		g_queue_push_tail(&pending->messages, slack_json_copy(json));
+
+		/* hold on until both lookups are started, in case they finish inline */
+		pending->waiting = 1;
+		if (obj)
+			pending->obj = g_object_ref(obj);
+		else {
+			pending->waiting++;
+			slack_conversation_retrieve(sa, channel, pending_conversation_cb, pending);
+		}
+	} else {
+		/* already waiting: queue behind the others (they nearly always arrive in order) */
+		const char *ts = json_get_prop_strptr(json, "ts");
+		GList *l = pending->messages.tail;
+		while (l && slack_ts_cmp(json_get_prop_strptr(l->data, "ts"), ts) > 0)
+			l = l->prev;
+		if (l)
+			g_queue_insert_after(&pending->messages, l, slack_json_copy(json));
+		else
+			g_queue_push_head(&pending->messages, slack_json_copy(json));
+		pending->waiting++;
+	}
+
+	if (uid) {
+		pending->waiting++;
+		slack_user_retrieve(sa, uid, pending_user_cb, pending);
+	}
+	pending_messages_done(sa, pending);
+}
+
+/* Chat typing flags expire after a few seconds, like purple_conv_im typing_timeout.
+ * They all last the same time, so rather than a timeout each they go on a wheel of TYPING_SLOTS lists,
+ * driven by a single timer (while anyone is typing) that expires the oldest list on each tick. */
+#define TYPING_TICK	500 /* ms */
+#define TYPING_SLOTS	8 /* ticks until expiry */
+
+struct typing {
+	slack_object_id chan, user;
+	unsigned slot;
+	GList link; /* in wheel->slot[slot] */
+};
+
+struct _SlackTypingWheel {
+	GHashTable *entries; /* struct typing -> itself */
+	GQueue slot[TYPING_SLOTS];
+	unsigned cur; /* slot for new entries, expired on the next lap */
+	guint timer;
+};
+
+static guint typing_hash(gconstpointer p) {
+	const struct typing *t = p;
+	return slack_object_id_hash(t->chan) ^ slack_object_id_hash(t->user);
+}
+
+static gboolean typing_equal(gconstpointer a, gconstpointer b) {
+	const struct typing *ta = a, *tb = b;
+	return slack_object_id_equal(ta->chan, tb->chan) && slack_object_id_equal(ta->user, tb->user);
+}
+
+static void typing_set_flag(SlackAccount *sa, struct typing *t, gboolean typing) {
+	/* either may be gone by the time this expires */
+	SlackChannel *chan = g_hash_table_lookup(sa->channels, t->chan);
+	SlackUser *user = g_hash_table_lookup(sa->users, t->user);
+	PurpleConvChat *chat = chan && user && user->object.name ? slack_channel_get_conversation(sa, chan) : NULL;
+	PurpleConvChatBuddy *cb = chat ? purple_conv_chat_cb_find(chat, user->object.name) : NULL;
+	if (!cb)
+		return;
+	PurpleConvChatBuddyFlags flags = typing ? cb->flags | PURPLE_CBFLAGS_TYPING : cb->flags & ~PURPLE_CBFLAGS_TYPING;
+	if (flags != cb->flags)
+		purple_conv_chat_user_set_flags(chat, user->object.name, flags);
+}
+
+static gboolean typing_tick(gpointer data) {
+	SlackAccount *sa = data;
+	SlackTypingWheel *wheel = sa->typing;
+
+	wheel->cur = (wheel->cur + 1) % TYPING_SLOTS;
+	GList *l;
+	while ((l = g_queue_pop_head_link(&wheel->slot[wheel->cur]))) {
+		struct typing *t = l->data;
+		typing_set_flag(sa, t, FALSE);
+		g_hash_table_remove(wheel->entries, t);
+	}
+
+	if (g_hash_table_size(wheel->entries))
+		return TRUE;
+	wheel->timer = 0;
+	return FALSE;
+}
+
+static void typing_start(SlackAccount *sa, SlackChannel *chan, SlackUser *user) {
+	SlackTypingWheel *wheel = sa->typing;
+	if (!wheel) {
+		wheel = sa->typing = g_new0(SlackTypingWheel, 1);
+		wheel->entries = g_hash_table_new_full(typing_hash, typing_equal, g_free, NULL);
+	}
+
+	struct typing key;
+	slack_object_id_copy(key.chan, chan->object.id);
+	slack_object_id_copy(key.user, user->object.id);
+	struct typing *t = g_hash_table_lookup(wheel->entries, &key);
+	if (t)
+		/* still typing: just move it to the newest slot */
+		g_queue_unlink(&wheel->slot[t->slot], &t->link);
+	else {
+		t = g_new0(struct typing, 1);
+		slack_object_id_copy(t->chan, key.chan);
+		slack_object_id_copy(t->user, key.user);
+		t->link.data = t;
+		g_hash_table_insert(wheel->entries, t, t);
+		typing_set_flag(sa, t, TRUE);
 	}
+	t->slot = wheel->cur;
+	g_queue_push_tail_link(&wheel->slot[t->slot], &t->link);
+
+	if (!wheel->timer)
+		wheel->timer = purple_timeout_add(TYPING_TICK, typing_tick, sa);
 }
 
-static void handle_message(SlackAccount *sa, gpointer data, SlackObject *obj) {
-	json_value *json = data;
-	return slack_handle_message(sa, obj, json, PURPLE_MESSAGE_RECV);
-	json_value_free(json);
+static void typing_stop(SlackAccount *sa, SlackChannel *chan, SlackUser *user) {
+	SlackTypingWheel *wheel = sa->typing;
+	if (!wheel || !g_hash_table_size(wheel->entries))
+		return;
+
+	struct typing key;
+	slack_object_id_copy(key.chan, chan->object.id);
+	slack_object_id_copy(key.user, user->object.id);
+	struct typing *t = g_hash_table_lookup(wheel->entries, &key);
+	if (!t)
+		return;
+	g_queue_unlink(&wheel->slot[t->slot], &t->link);
+	typing_set_flag(sa, t, FALSE);
+	g_hash_table_remove(wheel->entries, t);
 }
 
-gboolean slack_message(SlackAccount *sa, json_value *json) {
-	slack_conversation_retrieve(sa, json_get_prop_strptr(json, "channel"), handle_message, json);
-	return TRUE;
+void slack_typing_free(SlackAccount *sa) {
+	SlackTypingWheel *wheel = sa->typing;
+	if (!wheel)
+		return;
+	if (wheel->timer)
+		purple_timeout_remove(wheel->timer);
+	g_hash_table_destroy(wheel->entries);
+	g_free(wheel);
+	sa->typing = NULL;
 }
 
 void slack_user_typing(SlackAccount *sa, json_value *json) {
@@ -489,20 +713,37 @@ void slack_user_typing(SlackAccount *sa, json_value *json) {
 		serv_got_typing(sa->gc, user->object.name, 4, PURPLE_TYPING);
 	} else if (user && (chan = (SlackChannel*)slack_object_hash_table_lookup(sa->channels, channel_id))) {
 		/* Channel */
-#if 0
-		PurpleConvChat *chat = slack_channel_get_conversation(sa, chan);
-		PurpleConvChatBuddy *cb = chat ? purple_conv_chat_cb_find(chat, user->object.name) : NULL;
-		if (cb) {
-			purple_conv_chat_user_set_flags(chat, user->object.name, cb->flags | PURPLE_CBFLAGS_TYPING);
-			/* TODO: clear typing after 4 seconds (like purple_conv_im typing_timeout), but only if no more recent update, and don't crash if we're gone:
-			 * schedule a timeout and set a cb->attribute with the current time? keep a list of current typing chat/user pairs? */
-		}
-#endif
+		typing_start(sa, chan, user);
 	} else {
 		purple_debug_warning("slack", "Unhandled typing: %s@%s\n", user_id, channel_id);
 	}
 }
 
+/* Outgoing typing notices are sent at most once per TYPING_SEND_INTERVAL in each conversation */
+#define TYPING_SEND_INTERVAL	3 /* seconds */
+
+struct typing_sent {
+	slack_object_id id;
+	gint64 time; /* monotonic usec */
+	char channel[]; /* id as a json string */
+};
+
+void slack_conversation_typing(SlackAccount *sa, const slack_object_id id) {
+	struct typing_sent *sent = g_hash_table_lookup(sa->typing_sent, id);
+	gint64 now = g_get_monotonic_time();
+	if (!sent) {
+		GString *channel = append_json_string(g_string_new(NULL), id);
+		sent = g_malloc(sizeof(*sent) + channel->len + 1);
+		slack_object_id_copy(sent->id, id);
+		memcpy(sent->channel, channel->str, channel->len + 1);
+		g_string_free(channel, TRUE);
+		g_hash_table_insert(sa->typing_sent, sent->id, sent);
+	} else if (now - sent->time < TYPING_SEND_INTERVAL * G_USEC_PER_SEC)
+		return;
+	sent->time = now;
+	slack_rtm_send(sa, NULL, NULL, "typing", "channel", sent->channel, NULL);
+}
+
 unsigned int slack_send_typing(PurpleConnection *gc, const char *who, PurpleTypingState state) {
 	SlackAccount *sa = gc->proto_data;
 
@@ -513,9 +754,6 @@ unsigned int slack_send_typing(PurpleConnection *gc, const char *who, PurpleTypi
 	if (!user || !*user->im)
 		return 0;
 
-	GString *channel = append_json_string(g_string_new(NULL), user->im);
-	slack_rtm_send(sa, NULL, NULL, "typing", "channel", channel->str, NULL);
-	g_string_free(channel, TRUE);
-
-	return 3;
+	slack_conversation_typing(sa, user->im);
+	return TYPING_SEND_INTERVAL;
 }
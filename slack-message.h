@@ -5,8 +5,10 @@
 #include "slack.h"
 #include "slack-object.h"
 
+typedef struct _SlackTypingWheel SlackTypingWheel;
+
 gchar *slack_html_to_message(SlackAccount *sa, const char *s, PurpleMessageFlags flags);
-void slack_message_to_html(GString *html, SlackAccount *sa, gchar *s, PurpleMessageFlags *flags, gchar *prepend_newline_str);
+void slack_message_to_html(GString *html, SlackAccount *sa, const gchar *s, PurpleMessageFlags *flags, const gchar *prepend_newline_str);
 void slack_json_to_html(GString *html, SlackAccount *sa, json_value *json, PurpleMessageFlags *flags);
 /**
  * Display a message
@@ -16,9 +18,17 @@ void slack_json_to_html(GString *html, SlackAccount *sa, json_value *json, Purpl
  */
 void slack_handle_message(SlackAccount *sa, SlackObject *conv, json_value *json, PurpleMessageFlags flags);
 
+/* Drop messages still waiting on lookups without displaying them (on close) */
+void slack_pending_messages_abort(SlackAccount *sa);
+
 /* RTM event handlers */
-gboolean slack_message(SlackAccount *sa, json_value *json);
+void slack_message(SlackAccount *sa, json_value *json);
 void slack_user_typing(SlackAccount *sa, json_value *json);
+/* Forget who is typing in chats (on close) */
+void slack_typing_free(SlackAccount *sa);
+
+/* Tell the conversation (IM or channel id) we're typing, unless we did so recently */
+void slack_conversation_typing(SlackAccount *sa, const slack_object_id id);
 
 /* Purple protocol handlers */
 unsigned int slack_send_typing(PurpleConnection *gc, const char *who, PurpleTypingState state);
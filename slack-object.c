@@ -1,4 +1,4 @@
-#include "slack-object.h"
+#include "slack-intern.h"
 
 guint slack_object_id_hash(gconstpointer p) {
 	const guint *x = p+1;
@@ -14,7 +14,12 @@ G_DEFINE_ABSTRACT_TYPE(SlackObject, slack_object, G_TYPE_OBJECT);
 static void slack_object_finalize(GObject *gobj) {
 	SlackObject *obj = SLACK_OBJECT(gobj);
 
-	g_free(obj->name);
+	slack_intern_unref(obj->name);
+	slack_intern_unref(obj->last_mesg);
+	slack_intern_unref(obj->last_read);
+	slack_intern_unref(obj->last_mark);
+
+	G_OBJECT_CLASS(slack_object_parent_class)->finalize(gobj);
 }
 
 static void slack_object_class_init(SlackObjectClass *klass) {
@@ -1,6 +1,6 @@
 #include <string.h>
 
-#include <debug.h>
+#include "purple-debug.h"
 
 #include "slack-json.h"
 #include "slack-api.h"
@@ -9,6 +9,7 @@
 #include "slack-blist.h"
 #include "slack-message.h"
 #include "slack-channel.h"
+#include "slack-intern.h"
 #include "slack-rtm.h"
 
 struct _SlackRTMCall {
@@ -17,72 +18,223 @@ struct _SlackRTMCall {
 	gpointer data;
 };
 
-static gboolean rtm_msg(SlackAccount *sa, const char *type, json_value *json) {
-	if (!strcmp(type, "message")) {
-		return slack_message(sa, json);
-	}
-	else if (!strcmp(type, "user_typing")) {
-		slack_user_typing(sa, json);
-	}
-	else if (!strcmp(type, "presence_change") ||
-	         !strcmp(type, "presence_change_batch")) {
-		slack_presence_change(sa, json);
-	}
-	else if (!strcmp(type, "im_close")) {
-		slack_im_close(sa, json);
-	}
-	else if (!strcmp(type, "im_open")) {
-		slack_im_open(sa, json);
-	}
-	else if (!strcmp(type, "member_joined_channel")) {
-		slack_member_joined_channel(sa, json, TRUE);
-	}
-	else if (!strcmp(type, "member_left_channel")) {
-		slack_member_joined_channel(sa, json, FALSE);
-	}
-	else if (!strcmp(type, "user_change") ||
-		 !strcmp(type, "team_join")) {
-		slack_user_changed(sa, json);
-	}
-	else if (!strcmp(type, "im_created")) {
-		/* not necessarily (and probably in reality never) open, but works as no-op in that case */
-		slack_im_open(sa, json);
+struct rtm_handler {
+	SlackRTMHandler *handler;
+	gpointer data;
+	unsigned stats; /* index into sa->rtm_stats */
+};
+
+static GHashTable *rtm_handlers; /* const char *type -> struct rtm_handler */
+
+/* sa->rtm_stats slots not belonging to a handler */
+enum {
+	RTM_STATS_REPLY,
+	RTM_STATS_INVALID,
+	RTM_STATS_OTHER, /* unhandled types, which are up to the server */
+	RTM_STATS_HANDLERS
+};
+static GPtrArray *rtm_stats_types; /* sa->rtm_stats index -> const char *type */
+
+void slack_rtm_register(const char *type, SlackRTMHandler *handler, gpointer data) {
+	if (!rtm_handlers) {
+		rtm_handlers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+		rtm_stats_types = g_ptr_array_new();
+		g_ptr_array_add(rtm_stats_types, "(reply)");
+		g_ptr_array_add(rtm_stats_types, "(invalid)");
+		g_ptr_array_add(rtm_stats_types, "(other)");
 	}
-	else if (!strcmp(type, "channel_joined")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_MEMBER);
+	struct rtm_handler *h = g_hash_table_lookup(rtm_handlers, type);
+	if (!h) {
+		h = g_new(struct rtm_handler, 1);
+		h->stats = rtm_stats_types->len;
+		g_ptr_array_add(rtm_stats_types, (gpointer)type);
+		g_hash_table_insert(rtm_handlers, (gpointer)type, h);
 	}
-	else if (!strcmp(type, "group_joined") ||
-		 !strcmp(type, "group_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_GROUP);
+	h->handler = handler;
+	h->data = data;
+}
+
+static void rtm_message(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_message(sa, json);
+}
+
+static void rtm_user_typing(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_user_typing(sa, json);
+}
+
+static void rtm_presence_change(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_presence_change(sa, json);
+}
+
+static void rtm_im_close(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_im_close(sa, json);
+}
+
+static void rtm_im_open(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_im_open(sa, json);
+}
+
+static void rtm_member_joined_channel(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_member_joined_channel(sa, json, GPOINTER_TO_INT(data));
+}
+
+static void rtm_user_changed(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_user_changed(sa, json);
+}
+
+static void rtm_channel_update(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_channel_update(sa, json, GPOINTER_TO_INT(data));
+}
+
+static void rtm_hello(SlackAccount *sa, json_value *json, gpointer data) {
+	slack_login_step(sa);
+}
+
+void slack_rtm_init(void) {
+	slack_rtm_register("message",			rtm_message,			NULL);
+	slack_rtm_register("user_typing",		rtm_user_typing,		NULL);
+	slack_rtm_register("presence_change",		rtm_presence_change,		NULL);
+	slack_rtm_register("presence_change_batch",	rtm_presence_change,		NULL);
+	slack_rtm_register("im_close",			rtm_im_close,			NULL);
+	slack_rtm_register("im_open",			rtm_im_open,			NULL);
+	/* not necessarily (and probably in reality never) open, but works as no-op in that case */
+	slack_rtm_register("im_created",		rtm_im_open,			NULL);
+	slack_rtm_register("member_joined_channel",	rtm_member_joined_channel,	GINT_TO_POINTER(TRUE));
+	slack_rtm_register("member_left_channel",	rtm_member_joined_channel,	GINT_TO_POINTER(FALSE));
+	slack_rtm_register("user_change",		rtm_user_changed,		NULL);
+	slack_rtm_register("team_join",			rtm_user_changed,		NULL);
+	slack_rtm_register("channel_joined",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_MEMBER));
+	slack_rtm_register("group_joined",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_GROUP));
+	slack_rtm_register("group_unarchive",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_GROUP));
+	slack_rtm_register("channel_left",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_PUBLIC));
+	slack_rtm_register("channel_created",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_PUBLIC));
+	slack_rtm_register("channel_unarchive",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_PUBLIC));
+	slack_rtm_register("channel_rename",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_UNKNOWN));
+	slack_rtm_register("group_rename",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_UNKNOWN));
+	slack_rtm_register("channel_archive",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_DELETED));
+	slack_rtm_register("channel_deleted",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_DELETED));
+	slack_rtm_register("group_archive",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_DELETED));
+	slack_rtm_register("group_left",		rtm_channel_update,		GINT_TO_POINTER(SLACK_CHANNEL_DELETED));
+	slack_rtm_register("hello",			rtm_hello,			NULL);
+}
+
+static SlackRTMStats *rtm_stats(SlackAccount *sa, unsigned i) {
+	if (i >= sa->rtm_stats->len)
+		g_array_set_size(sa->rtm_stats, rtm_stats_types->len);
+	return &g_array_index(sa->rtm_stats, SlackRTMStats, i);
+}
+
+static void rtm_latency_add(SlackRTMLatency *lat, gint64 usec) {
+	unsigned b = 0;
+	lat->total += usec;
+	if (usec > lat->max)
+		lat->max = usec;
+	while (usec && b < SLACK_RTM_STATS_BUCKETS-1) {
+		usec >>= 1;
+		b++;
 	}
-	else if (!strcmp(type, "channel_left") ||
-	         !strcmp(type, "channel_created") ||
-	         !strcmp(type, "channel_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
+	lat->hist[b]++;
+}
+
+static void rtm_latency_format(GString *str, const char *name, const SlackRTMLatency *lat, unsigned long count) {
+	g_string_append_printf(str, "; %s avg %" G_GUINT64_FORMAT "us max %" G_GUINT64_FORMAT "us [", name, lat->total / count, lat->max);
+	gboolean first = TRUE;
+	for (unsigned b = 0; b < SLACK_RTM_STATS_BUCKETS; b++) {
+		if (!lat->hist[b])
+			continue;
+		g_string_append_printf(str, "%s%s%luus:%lu", first ? "" : " ", b < SLACK_RTM_STATS_BUCKETS-1 ? "<" : ">=", 1ul << (b < SLACK_RTM_STATS_BUCKETS-1 ? b : b-1), lat->hist[b]);
+		first = FALSE;
 	}
-	else if (!strcmp(type, "channel_rename") ||
-		 !strcmp(type, "group_rename")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_UNKNOWN);
+	g_string_append_c(str, ']');
+}
+
+static gint rtm_stats_cmp(gconstpointer a, gconstpointer b, gpointer data) {
+	GArray *stats = data;
+	unsigned long ca = g_array_index(stats, SlackRTMStats, *(const unsigned *)a).count;
+	unsigned long cb = g_array_index(stats, SlackRTMStats, *(const unsigned *)b).count;
+	return (ca < cb) - (ca > cb);
+}
+
+GString *slack_rtm_stats_format(SlackAccount *sa, const char *eol) {
+	GString *str = g_string_new(NULL);
+	unsigned *types = g_new(unsigned, sa->rtm_stats->len);
+	unsigned n = 0;
+	for (unsigned i = 0; i < sa->rtm_stats->len; i++)
+		if (g_array_index(sa->rtm_stats, SlackRTMStats, i).count)
+			types[n++] = i;
+	g_qsort_with_data(types, n, sizeof(*types), rtm_stats_cmp, sa->rtm_stats);
+
+	if (sa->rtm) {
+		unsigned long reads, messages;
+		size_t bufsize;
+		purple_websocket_get_counts(sa->rtm, &reads, &messages, &bufsize);
+		g_string_append_printf(str, "(websocket): %lu reads, %lu messages (%.2f reads/message), %zu byte buffer", reads, messages, messages ? (double)reads / messages : 0., bufsize);
 	}
-	else if (!strcmp(type, "channel_archive") ||
-		 !strcmp(type, "channel_deleted") ||
-		 !strcmp(type, "group_archive") ||
-		 !strcmp(type, "group_left")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_DELETED);
+
+	unsigned long connections, requests;
+	purple_http_pool_get_counts(sa->api_pool, &connections, &requests);
+	if (str->len)
+		g_string_append(str, eol);
+	g_string_append_printf(str, "(api): %lu connections, %lu requests", connections, requests);
+	g_string_append(str, eol);
+	g_string_append_printf(str, "(presence): %lu received, %lu applied", sa->presence_received, sa->presence_applied);
+	slack_intern_stats_format(sa, str, eol);
+
+	/* escaped for display in a conversation */
+	gboolean html = !strcmp(eol, "<br>");
+	for (unsigned i = 0; i < n; i++) {
+		const char *type = g_ptr_array_index(rtm_stats_types, types[i]);
+		SlackRTMStats *stats = rtm_stats(sa, types[i]);
+		if (str->len)
+			g_string_append(str, eol);
+		gchar *escaped = html ? g_markup_escape_text(type, -1) : NULL;
+		g_string_append_printf(str, "%s: %lu, %" G_GUINT64_FORMAT " bytes", escaped ?: type, stats->count, stats->bytes);
+		g_free(escaped);
+		rtm_latency_format(str, "parse", &stats->parse, stats->count);
+		rtm_latency_format(str, "handler", &stats->handler, stats->count);
 	}
-	else if (!strcmp(type, "hello")) {
-		slack_login_step(sa);
+
+	g_free(types);
+	return str;
+}
+
+void slack_rtm_stats_dump(SlackAccount *sa) {
+	GString *str = slack_rtm_stats_format(sa, "\n");
+	DEBUG_INFO("slack", "RTM statistics:\n%s\n", str->str);
+
+	const char *file = purple_account_get_string(sa->account, "rtm_stats_file", NULL);
+	if (file && *file) {
+		g_string_append_c(str, '\n');
+		GError *error = NULL;
+		if (!g_file_set_contents(file, str->str, str->len, &error)) {
+			DEBUG_WARNING("slack", "Could not write RTM statistics: %s\n", error->message);
+			g_error_free(error);
+		}
 	}
-	else {
-		purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+	g_string_free(str, TRUE);
+}
+
+static gboolean stats_timer(gpointer data) {
+	slack_rtm_stats_dump(data);
+	return TRUE;
+}
+
+/* Returns the sa->rtm_stats index to count it under */
+static unsigned rtm_msg(SlackAccount *sa, const char *type, json_value *json) {
+	struct rtm_handler *h = rtm_handlers ? g_hash_table_lookup(rtm_handlers, type) : NULL;
+
+	if (!h) {
+		DEBUG_INFO("slack", "Unhandled RTM type %s\n", type);
+		return RTM_STATS_OTHER;
 	}
-	return FALSE;
+	h->handler(sa, json, h->data);
+	return h->stats;
 }
 
 static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, const guchar *msg, size_t len) {
 	SlackAccount *sa = data;
 
-	purple_debug_misc("slack", "RTM %x: %.*s\n", op, (int)len, msg);
+	DEBUG_MISC("slack", "RTM %x: %.*s\n", op, slack_debug_payload_len(len), msg);
 	switch (op) {
 		case PURPLE_WEBSOCKET_TEXT:
 			break;
@@ -99,11 +251,16 @@ static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, con
 			return;
 	}
 
-	json_value *json = json_parse((const char *)msg, len);
+	/* parsed messages only live until the next one: handlers must copy anything they keep */
+	gint64 start = g_get_monotonic_time();
+	json_value *json = slack_json_arena_parse(sa->rtm_arena, (const char *)msg, len);
+	gint64 parsed = g_get_monotonic_time();
 	json_value *reply_to = json_get_prop_type(json, "reply_to", integer);
 	const char *type = json_get_prop_strptr(json, "type");
+	unsigned stats_index = RTM_STATS_INVALID;
 
 	if (reply_to) {
+		stats_index = RTM_STATS_REPLY;
 		SlackRTMCall *call = g_hash_table_lookup(sa->rtm_call, GUINT_TO_POINTER((guint) reply_to->u.integer));
 		if (call) {
 			g_hash_table_steal(sa->rtm_call, GUINT_TO_POINTER((guint) reply_to->u.integer));
@@ -119,18 +276,22 @@ static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, con
 		}
 	}
 	else if (type) {
-		if (rtm_msg(sa, type, json))
-			json = NULL;
+		stats_index = rtm_msg(sa, type, json);
 	}
 	else {
-		purple_debug_error("slack", "RTM: %.*s\n", (int)len, msg);
+		DEBUG_ERROR("slack", "RTM: %.*s\n", slack_debug_payload_len(len), msg);
 		purple_connection_error_reason(sa->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
 				"Could not parse RTM JSON");
 	}
 
-	if (json)
-		json_value_free(json);
+	SlackRTMStats *stats = rtm_stats(sa, stats_index);
+	stats->count++;
+	stats->bytes += len;
+	rtm_latency_add(&stats->parse, parsed - start);
+	rtm_latency_add(&stats->handler, g_get_monotonic_time() - parsed);
+
+	slack_json_arena_reset(sa->rtm_arena);
 }
 
 static gboolean ping_timer(gpointer data) {
@@ -181,10 +342,16 @@ static void rtm_connect_cb(SlackAccount *sa, gpointer data, json_value *json, co
 	slack_blist_init(sa);
 
 	slack_login_step(sa);
-	purple_debug_info("slack", "RTM URL: %s\n", url);
+	DEBUG_INFO("slack", "RTM URL: %s\n", url);
 	sa->rtm = purple_websocket_connect(sa->account, url, NULL, rtm_cb, sa);
+	if (sa->rtm)
+		purple_websocket_set_input_max(sa->rtm, 1024 * purple_account_get_int(sa->account, "rtm_buffer_max", 256));
 
 	sa->ping_timer = purple_timeout_add_seconds(60, ping_timer, sa->rtm);
+
+	const char *stats_file = purple_account_get_string(sa->account, "rtm_stats_file", NULL);
+	if (stats_file && *stats_file && !sa->stats_timer)
+		sa->stats_timer = purple_timeout_add_seconds(60, stats_timer, sa);
 }
 
 void slack_rtm_cancel(SlackRTMCall *call) {
@@ -193,23 +360,62 @@ void slack_rtm_cancel(SlackRTMCall *call) {
 	g_free(call);
 }
 
+/* key/value pairs slack_rtm_send can hold on the stack; any more go on the heap */
+#define RTM_SEND_ARGS 4
+
 void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, ...) {
 	guint id = ++sa->rtm_id;
 
-	GString *json = g_string_new(NULL);
-	g_string_printf(json, "{\"id\":%u,\"type\":\"%s\"", id, type);
+	/* the message is sent as segments pointing at the arguments, so only the header is formatted */
+	char head[128];
+	PurpleWebsocketVec stack[2 + 4*RTM_SEND_ARGS];
+	PurpleWebsocketVec *vec = stack;
+	GArray *heap = NULL;
+	unsigned n = 0;
+	size_t len = 0;
+#define ADD(P, L) ({ \
+		vec[n].base = (P); \
+		len += vec[n++].len = (L); \
+	})
+
+	int hlen = g_snprintf(head, sizeof(head), "{\"id\":%u,\"type\":\"%s\"", id, type);
+	g_return_if_fail(hlen < (int)sizeof(head));
+	ADD(head, hlen);
 	va_list qargs;
 	va_start(qargs, type);
 	const char *key;
 	while ((key = va_arg(qargs, const char*))) {
 		const char *val = va_arg(qargs, const char*);
-		g_string_append_printf(json, ",\"%s\":%s", key, val);
+		/* room for this pair and the closing brace */
+		if (n + 5 > G_N_ELEMENTS(stack)) {
+			if (!heap) {
+				heap = g_array_sized_new(FALSE, FALSE, sizeof(*vec), 2 * G_N_ELEMENTS(stack));
+				g_array_append_vals(heap, stack, n);
+			}
+			g_array_set_size(heap, n + 5);
+			vec = (PurpleWebsocketVec *)heap->data;
+		}
+		ADD(",\"", 2);
+		ADD(key, strlen(key));
+		ADD("\":", 2);
+		ADD(val, strlen(val));
 	}
 	va_end(qargs);
-	g_string_append_c(json, '}');
-	g_return_if_fail(json->len <= 16384);
+	ADD("}", 1);
+#undef ADD
+	if (len > 16384) {
+		if (heap)
+			g_array_free(heap, TRUE);
+		g_return_if_reached();
+	}
 
-	purple_debug_misc("slack", "RTM: %.*s\n", (int)json->len, json->str);
+	if (slack_debug_wanted(PURPLE_DEBUG_MISC, "slack")) {
+		GString *json = g_string_sized_new(len);
+		for (unsigned i = 0; i < n; i++)
+			g_string_append_len(json, vec[i].base, vec[i].len);
+		purple_debug_misc("slack", "RTM: %.*s\n", slack_debug_payload_len(json->len), json->str);
+		g_string_free(json, TRUE);
+	}
 
 	if (callback) {
 		SlackRTMCall *call = g_new(SlackRTMCall, 1);
@@ -219,8 +425,9 @@ void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_
 		g_hash_table_insert(sa->rtm_call, GUINT_TO_POINTER(id), call);
 	}
 
-	purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_TEXT, (guchar*)json->str, json->len);
-	g_string_free(json, TRUE);
+	purple_websocket_sendv(sa->rtm, PURPLE_WEBSOCKET_TEXT, vec, n);
+	if (heap)
+		g_array_free(heap, TRUE);
 }
 
 void slack_rtm_connect(SlackAccount *sa) {
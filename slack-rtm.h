@@ -8,6 +8,33 @@ typedef struct _SlackRTMCall SlackRTMCall;
 
 typedef void SlackRTMCallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
 
+/* Handler for incoming RTM events of a given type */
+typedef void SlackRTMHandler(SlackAccount *sa, json_value *json, gpointer data);
+
+/* log2 microsecond latency buckets, the last one open-ended */
+#define SLACK_RTM_STATS_BUCKETS 20
+
+typedef struct _SlackRTMLatency {
+	guint64 total, max; /* usec */
+	unsigned long hist[SLACK_RTM_STATS_BUCKETS];
+} SlackRTMLatency;
+
+/* Per-account counters for each registered RTM event type, plus replies, invalid and other messages (in sa->rtm_stats) */
+typedef struct _SlackRTMStats {
+	unsigned long count;
+	guint64 bytes;
+	SlackRTMLatency parse, handler;
+} SlackRTMStats;
+
+/* Register the builtin RTM event handlers */
+void slack_rtm_init(void);
+/* Register (or replace) the handler for RTM events of type (a static string) */
+void slack_rtm_register(const char *type, SlackRTMHandler *handler, gpointer data);
+/* Describe the connections, memory use, and sa->rtm_stats (busiest types first), with lines separated by eol */
+GString *slack_rtm_stats_format(SlackAccount *sa, const char *eol);
+/* Log (and write to the rtm_stats_file option, if set) the current sa->rtm_stats */
+void slack_rtm_stats_dump(SlackAccount *sa);
+
 void slack_rtm_connect(SlackAccount *sa);
 /* Send an RTM message of the given type (unquoted, escaped json string) with the given key (unquoted, escaped json string), value (const char *json) pairs */
 void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, /* const char *key1, const char *json1, */ ...) G_GNUC_NULL_TERMINATED;
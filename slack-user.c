@@ -5,15 +5,17 @@
 #include "slack-blist.h"
 #include "slack-user.h"
 #include "slack-im.h"
+#include "slack-cache.h"
+#include "slack-intern.h"
 
 G_DEFINE_TYPE(SlackUser, slack_user, SLACK_TYPE_OBJECT);
 
 static void slack_user_finalize(GObject *gobj) {
 	SlackUser *user = SLACK_USER(gobj);
 
-	g_free(user->status);
-	g_free(user->avatar_hash);
-	g_free(user->avatar_url);
+	slack_intern_unref(user->status);
+	slack_intern_unref(user->avatar_hash);
+	slack_intern_unref(user->avatar_url);
 
 	G_OBJECT_CLASS(slack_user_parent_class)->finalize(gobj);
 }
@@ -72,8 +74,7 @@ SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
 
 		if (user->object.name)
 			g_hash_table_remove(sa->user_names, user->object.name);
-		g_free(user->object.name);
-		user->object.name = g_strdup(name);
+		slack_intern_set(&user->object.name, name);
 		g_hash_table_insert(sa->user_names, user->object.name, user);
 		if (user->object.buddy)
 			purple_blist_rename_buddy(user_buddy(user), user->object.name);
@@ -86,16 +87,13 @@ SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
 			serv_got_alias(sa->gc, name, display);
 
 		const char *status = json_get_prop_strptr1(profile, "status_text") ?: json_get_prop_strptr1(profile, "current_status");
-		g_free(user->status);
-		user->status = g_strdup(status);
+		slack_intern_set(&user->status, status);
 
 		if (purple_account_get_bool(sa->account, "enable_avatar_download", FALSE)) {
 			const char *avatar_hash = json_get_prop_strptr1(profile, "avatar_hash");
 			const char *avatar_url = json_get_prop_strptr1(profile, "image_192");
-			g_free(user->avatar_hash);
-			g_free(user->avatar_url);
-			user->avatar_hash = g_strdup(avatar_hash);
-			user->avatar_url = g_strdup(avatar_url);
+			slack_intern_set(&user->avatar_hash, avatar_hash);
+			slack_intern_set(&user->avatar_url, avatar_url);
 			slack_update_avatar(sa, user);
 		}
 
@@ -118,7 +116,15 @@ void slack_user_changed(SlackAccount *sa, json_value *json) {
 	slack_user_update(sa, json_get_prop(json, "user"));
 }
 
+static void users_list_member(SlackAccount *sa, gpointer data, json_value *json) {
+	slack_user_update(sa, json);
+}
+
+#define USERS_LIST_CALL(sa, ARGS...) \
+	slack_api_call_stream(sa, users_list_cb, "members", users_list_member, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT, ##ARGS, NULL)
+
 static void users_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	/* members have already been passed to users_list_member */
 	json_value *members = json_get_prop_type(json, "members", array);
 	if (!members) {
 		purple_connection_error_reason(sa->gc,
@@ -126,19 +132,67 @@ static void users_list_cb(SlackAccount *sa, gpointer data, json_value *json, con
 		return;
 	}
 
-	for (unsigned i = 0; i < members->u.array.length; i ++)
-		slack_user_update(sa, members->u.array.values[i]);
-
 	char *cursor = json_get_prop_strptr1(json_get_prop(json, "response_metadata"), "next_cursor");
 	if (cursor)
-		slack_api_call(sa, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT, "cursor", cursor, NULL);
+		USERS_LIST_CALL(sa, "cursor", cursor);
 	else
 		slack_login_step(sa);
 }
 
 void slack_users_load(SlackAccount *sa) {
-	g_hash_table_remove_all(sa->users);
-	slack_api_call(sa, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT, NULL);
+	if (sa->lazy_users)
+		/* users will be retrieved as they come up */
+		return slack_login_step(sa);
+	/* update whatever we already know (self, the cache) in place */
+	USERS_LIST_CALL(sa);
+}
+
+/* Background paging through users.list (for lazy_users), so that names fill in eventually */
+#define USERS_SYNC_DELAY	250 /* ms between pages */
+#define USERS_SYNC_BUSY_DELAY	2000 /* ms to wait while more important calls are queued */
+
+#define USERS_SYNC_CALL(sa, ARGS...) \
+	slack_api_call_stream_priority(sa, SLACK_API_BULK, users_sync_cb, "members", users_list_member, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT, ##ARGS, NULL)
+
+static gboolean users_sync_next(gpointer data);
+
+static void users_sync_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	if (error) {
+		purple_debug_warning("slack", "user sync stopped: %s\n", error);
+		return;
+	}
+
+	char *cursor = json_get_prop_strptr1(json_get_prop(json, "response_metadata"), "next_cursor");
+	g_free(sa->users_sync_cursor);
+	sa->users_sync_cursor = g_strdup(cursor);
+	if (cursor)
+		sa->users_sync_timer = purple_timeout_add(USERS_SYNC_DELAY, users_sync_next, sa);
+	else {
+		purple_debug_info("slack", "user sync done: %u users\n", g_hash_table_size(sa->users));
+		slack_cache_save(sa);
+	}
+}
+
+static gboolean users_sync_next(gpointer data) {
+	SlackAccount *sa = data;
+	sa->users_sync_timer = 0;
+
+	if (slack_api_queued(sa, SLACK_API_DEFAULT)) {
+		/* stay out of the way */
+		sa->users_sync_timer = purple_timeout_add(USERS_SYNC_BUSY_DELAY, users_sync_next, sa);
+		return FALSE;
+	}
+
+	if (sa->users_sync_cursor)
+		USERS_SYNC_CALL(sa, "cursor", sa->users_sync_cursor);
+	else
+		USERS_SYNC_CALL(sa);
+	return FALSE;
+}
+
+void slack_users_sync(SlackAccount *sa) {
+	if (!sa->users_sync_timer)
+		sa->users_sync_timer = purple_timeout_add(USERS_SYNC_DELAY, users_sync_next, sa);
 }
 
 struct user_retrieve {
@@ -168,15 +222,42 @@ void slack_user_retrieve(SlackAccount *sa, const char *uid, SlackUserCallback *c
 	slack_api_call(sa, user_retrieve_cb, lookup, "users.info", "user", uid, NULL);
 }
 
+/* Presence changes (often thousands at once after connecting) are collected for a moment,
+ * keeping only the latest for each user, and then applied together */
+#define PRESENCE_BATCH_DELAY	200 /* ms */
+
+static gboolean presence_flush(gpointer data) {
+	SlackAccount *sa = data;
+	sa->presence_timer = 0;
+
+	unsigned applied = 0;
+	GHashTableIter iter;
+	gpointer id, presence;
+	g_hash_table_iter_init(&iter, sa->presence_pending);
+	while (g_hash_table_iter_next(&iter, &id, &presence)) {
+		SlackUser *user = g_hash_table_lookup(sa->users, id);
+		if (!user || !user->object.name)
+			continue;
+		/* no need to look up buddies by name for nothing */
+		if (user->object.buddy && purple_presence_is_status_active(purple_buddy_get_presence(user_buddy(user)), presence))
+			continue;
+		purple_prpl_got_user_status(sa->account, user->object.name, presence, NULL);
+		applied++;
+	}
+
+	purple_debug_misc("slack", "applied %u of %u presence changes\n", applied, g_hash_table_size(sa->presence_pending));
+	sa->presence_applied += applied;
+	g_hash_table_remove_all(sa->presence_pending);
+	return FALSE;
+}
+
 static void presence_set(SlackAccount *sa, json_value *json, const char *presence) {
 	if (json->type != json_string)
 		return;
-	const char *id = json->u.string.ptr;
-	SlackUser *user = (SlackUser*)slack_object_hash_table_lookup(sa->users, id);
-	if (!user || !user->object.name)
-		return;
-	purple_debug_misc("slack", "setting user %s presence to %s\n", user->object.name, presence);
-	purple_prpl_got_user_status(sa->account, user->object.name, presence, NULL);
+	slack_object_id id;
+	slack_object_id_set(id, json->u.string.ptr);
+	sa->presence_received++;
+	g_hash_table_replace(sa->presence_pending, g_memdup(id, SLACK_OBJECT_ID_SIZ), (gpointer)presence);
 }
 
 void slack_presence_change(SlackAccount *sa, json_value *json) {
@@ -186,12 +267,16 @@ void slack_presence_change(SlackAccount *sa, json_value *json) {
 	const char *presence = json_get_prop_strptr(json, "presence");
 	if (!users || !presence)
 		return;
+	presence = g_intern_string(presence);
 
 	if (users->type == json_array)
 		for (unsigned i = 0; i < users->u.array.length; i ++)
 			presence_set(sa, users->u.array.values[i], presence);
 	else
 		presence_set(sa, users, presence);
+
+	if (!sa->presence_timer)
+		sa->presence_timer = purple_timeout_add(PRESENCE_BATCH_DELAY, presence_flush, sa);
 }
 
 char *slack_status_text(PurpleBuddy *buddy) {
@@ -285,8 +370,7 @@ void slack_get_info(PurpleConnection *gc, const char *who) {
 
 static void avatar_load_next(SlackAccount *sa);
 
-static void avatar_cb(G_GNUC_UNUSED PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
-	SlackAccount *sa = data;
+static void avatar_cb(SlackAccount *sa, G_GNUC_UNUSED gpointer data, const gchar *buf, gsize len, const char *error) {
 	SlackUser *user = g_queue_pop_head(sa->avatar_queue);
 	g_return_if_fail(user);
 	if (error) {
@@ -305,7 +389,7 @@ static void avatar_load_next(SlackAccount *sa) {
 	if (!user)
 		return;
 	purple_debug_misc("slack", "downloading avatar for %s\n", user->object.name);
-	purple_util_fetch_url_request_len_with_account(sa->account, user->avatar_url, TRUE, NULL, TRUE, NULL, FALSE, 131072, avatar_cb, sa);
+	slack_api_fetch(sa, avatar_cb, NULL, user->avatar_url, 131072);
 }
 
 void slack_update_avatar(SlackAccount *sa, SlackUser *user) {
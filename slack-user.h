@@ -26,6 +26,8 @@ static inline PurpleBuddy *user_buddy(SlackUser *user) {
 
 /* Initialization */
 void slack_users_load(SlackAccount *sa);
+/* Start loading all users in the background (when not done by slack_users_load) */
+void slack_users_sync(SlackAccount *sa);
 
 SlackUser *slack_user_update(SlackAccount *sa, json_value *json);
 
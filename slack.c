@@ -10,6 +10,7 @@
 #include <version.h>
 
 #include "slack.h"
+#include "slack-json.h"
 #include "slack-api.h"
 #include "slack-rtm.h"
 #include "slack-user.h"
@@ -19,6 +20,7 @@
 #include "slack-blist.h"
 #include "slack-message.h"
 #include "slack-cmd.h"
+#include "slack-cache.h"
 
 static const char *slack_list_icon(G_GNUC_UNUSED PurpleAccount * account, G_GNUC_UNUSED PurpleBuddy * buddy) {
 	return "slack";
@@ -145,12 +147,19 @@ static void slack_login(PurpleAccount *account) {
 	sa->api_url = g_strdup_printf("https://%s/api", host ? host+1 : "slack.com");
 
 	sa->token = g_strdup(purple_url_encode(token));
+	sa->lazy_users = purple_account_get_bool(account, "lazy_users", FALSE);
+
+	slack_api_init(sa);
+	sa->rtm_arena = slack_json_arena_new();
 
 	sa->rtm_call = g_hash_table_new_full(g_direct_hash,        g_direct_equal,        NULL, (GDestroyNotify)slack_rtm_cancel);
+	sa->rtm_stats = g_array_new(FALSE, TRUE, sizeof(SlackRTMStats));
 
 	sa->users    = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_object_unref);
 	sa->user_names = g_hash_table_new_full(g_str_hash,         g_str_equal,           NULL, NULL);
 	sa->ims      = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, NULL);
+	sa->presence_pending = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, g_free, NULL);
+	sa->presence_subs = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, g_free, NULL);
 
 	sa->channels = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_object_unref);
 	sa->channel_names = g_hash_table_new_full(g_str_hash,      g_str_equal,           NULL, NULL);
@@ -158,6 +167,9 @@ static void slack_login(PurpleAccount *account) {
 
 	sa->avatar_queue = g_queue_new();
 
+	sa->pending_messages = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, NULL);
+	sa->typing_sent = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_free);
+
 	sa->buddies = g_hash_table_new_full(/* slack_object_id_hash, slack_object_id_equal, */ g_str_hash, g_str_equal, NULL, NULL);
 
 	sa->mark_list = MARK_LIST_END;
@@ -168,9 +180,18 @@ static void slack_login(PurpleAccount *account) {
 	slack_login_step(sa);
 }
 
+static void slack_connected(SlackAccount *sa) {
+	slack_presence_sub(sa);
+	if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		purple_connection_set_state(sa->gc, PURPLE_CONNECTED);
+}
+
 void slack_login_step(SlackAccount *sa) {
-#define MSG(msg) \
-	purple_connection_update_progress(sa->gc, msg, ++sa->login_step, 6)
+#define MSG(msg) ({ \
+		++sa->login_step; \
+		if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc)) \
+			purple_connection_update_progress(sa->gc, msg, sa->login_step, 6); \
+	})
 	switch (sa->login_step) {
 		case 0:
 			MSG("Requesting RTM");
@@ -184,6 +205,9 @@ void slack_login_step(SlackAccount *sa) {
 			MSG("RTM Connected");
 			break;
 		case 3: /* rtm_msg("hello") */
+			/* with a snapshot of everything, we can sign on now and reload in the background */
+			if (slack_cache_load(sa))
+				slack_connected(sa);
 			MSG("Loading Users");
 			slack_users_load(sa);
 			break;
@@ -192,8 +216,10 @@ void slack_login_step(SlackAccount *sa) {
 			slack_conversations_load(sa);
 			break;
 		case 5:
-			slack_presence_sub(sa);
-			purple_connection_set_state(sa->gc, PURPLE_CONNECTED);
+			slack_cache_save(sa);
+			slack_connected(sa);
+			if (sa->lazy_users)
+				slack_users_sync(sa);
 	}
 #undef MSG
 }
@@ -215,13 +241,47 @@ static void slack_close(PurpleConnection *gc) {
 		sa->ping_timer = 0;
 	}
 
+	if (sa->stats_timer) {
+		purple_timeout_remove(sa->stats_timer);
+		sa->stats_timer = 0;
+	}
+
+	if (sa->users_sync_timer) {
+		purple_timeout_remove(sa->users_sync_timer);
+		sa->users_sync_timer = 0;
+	}
+
+	if (sa->presence_timer) {
+		purple_timeout_remove(sa->presence_timer);
+		sa->presence_timer = 0;
+	}
+
+	slack_typing_free(sa);
+	g_hash_table_destroy(sa->typing_sent);
+
+	if (sa->presence_sub_timer) {
+		purple_timeout_remove(sa->presence_sub_timer);
+		sa->presence_sub_timer = 0;
+	}
+
 	if (sa->rtm) {
 		purple_websocket_abort(sa->rtm);
 		sa->rtm = NULL;
 	}
 	g_hash_table_destroy(sa->rtm_call);
+	slack_rtm_stats_dump(sa);
+	g_array_free(sa->rtm_stats, TRUE);
+
+	if (sa->login_step >= 5)
+		/* pick up any changes since login */
+		slack_cache_save(sa);
 
+	slack_pending_messages_abort(sa);
+	/* keep only the avatar in flight, so its failure doesn't start the next one */
+	while (g_queue_get_length(sa->avatar_queue) > 1)
+		g_object_unref(g_queue_pop_tail(sa->avatar_queue));
 	slack_api_disconnect(sa);
+	slack_json_arena_free(sa->rtm_arena);
 
 	if (sa->roomlist)
 		purple_roomlist_unref(sa->roomlist);
@@ -231,9 +291,14 @@ static void slack_close(PurpleConnection *gc) {
 	g_hash_table_destroy(sa->channel_names);
 	g_hash_table_destroy(sa->channels);
 
+	g_hash_table_destroy(sa->presence_subs);
+	if (sa->presence_subs_sent)
+		g_hash_table_destroy(sa->presence_subs_sent);
+	g_hash_table_destroy(sa->presence_pending);
 	g_hash_table_destroy(sa->ims);
 	g_hash_table_destroy(sa->user_names);
 	g_hash_table_destroy(sa->users);
+	g_free(sa->users_sync_cursor);
 
 	g_queue_foreach(sa->avatar_queue, (GFunc)g_object_unref, NULL);
 	g_queue_free(sa->avatar_queue);
@@ -375,12 +440,25 @@ static void init_plugin(G_GNUC_UNUSED PurplePlugin *plugin)
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 		purple_account_option_bool_new("Download user avatars", "enable_avatar_download", FALSE));
 
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_bool_new("Cache users and channels for faster login", "cache", TRUE));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_bool_new("Only load users as needed (for large teams)", "lazy_users", FALSE));
+
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 		purple_account_option_string_new("Prepend attachment lines with this string", "attachment_prefix", "▎ "));
 
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 		purple_account_option_int_new("Seconds to delay when ratelimited", "ratelimit_delay", 15));
 
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_string_new("Write RTM statistics to this file every minute", "rtm_stats_file", ""));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Maximum RTM receive buffer (KB)", "rtm_buffer_max", 256));
+
+	slack_rtm_init();
 	slack_cmd_register();
 }
 
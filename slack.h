@@ -6,6 +6,7 @@
 #include <account.h>
 
 #include "glibcompat.h"
+#include "purple-http.h"
 #include "purple-websocket.h"
 #include "slack-object.h"
 
@@ -21,10 +22,16 @@ typedef struct _SlackAccount {
 
 	short login_step;
 	struct _SlackAPICall *api_calls; /* linked list */
+	struct _SlackJSONArena *api_arena; /* api_cb responses */
+	PurpleHttpPool *api_pool;
+	struct _SlackAPIScheduler *api_sched;
 	PurpleWebsocket *rtm;
+	struct _SlackJSONArena *rtm_arena; /* rtm_cb messages */
 	guint rtm_id;
 	GHashTable *rtm_call; /* unsigned rtm_id -> SlackRTMCall */
+	GArray *rtm_stats; /* SlackRTMStats for each RTM event type (see slack-rtm.c) */
 	guint ping_timer;
+	guint stats_timer; /* rtm_stats_file dump */
 
 	struct _SlackTeam {
 		char *id;
@@ -36,6 +43,16 @@ typedef struct _SlackAccount {
 	GHashTable *users; /* slack_object_id user_id -> SlackUser (ref) */
 	GHashTable *user_names; /* char *user_name -> SlackUser (no ref) */
 	GHashTable *ims; /* slack_object_id im_id -> SlackUser (no ref) */
+	gboolean lazy_users; /* only look users up as they come up (lazy_users option, at login) */
+	guint users_sync_timer; /* background users.list (lazy_users) */
+	char *users_sync_cursor;
+	GHashTable *presence_pending; /* slack_object_id user_id -> const char *presence (interned), until presence_timer */
+	guint presence_timer;
+	unsigned long presence_received, presence_applied; /* user presence changes */
+	GHashTable *presence_subs; /* slack_object_id user_id set: users with IM buddies */
+	GHashTable *presence_subs_sent; /* presence_subs as of the last presence_sub, NULL if none on this connection */
+	gboolean presence_subs_changed; /* since the last presence_sub */
+	guint presence_sub_timer;
 
 	GHashTable *channels; /* slack_object_id channel_id -> SlackChannel (ref) */
 	GHashTable *channel_names; /* char *chan_name -> SlackChannel (no ref) */
@@ -46,6 +63,10 @@ typedef struct _SlackAccount {
 	GHashTable *buddies; /* char *slack_id -> PurpleBListNode */
 	PurpleRoomlist *roomlist;
 
+	struct _SlackTypingWheel *typing; /* who is typing in chats (slack-message.c) */
+	GHashTable *typing_sent; /* slack_object_id conversation_id -> our last typing notice (slack-message.c) */
+	GHashTable *pending_messages; /* slack_object_id channel_id -> messages waiting on conversation lookup (slack-message.c) */
+
 	guint mark_timer;
 	SlackObject *mark_list;
 
@@ -0,0 +1,391 @@
+/* Standalone checks for code that is hard to exercise against a live server: run with "make test" */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+/* for the static helpers and struct _PurpleWebsocket */
+#include "purple-websocket.c"
+
+#include <eventloop.h>
+
+#include "slack-intern.h"
+#include "slack-user.h"
+#include "slack-channel.h"
+#include "slack-message.h"
+
+static unsigned failures;
+
+#define CHECK(COND, FORMAT, ARGS...) ({ \
+		if (!(COND)) { \
+			failures++; \
+			fprintf(stderr, "%s:%d: " FORMAT "\n", __FILE__, __LINE__, ##ARGS); \
+		} \
+	})
+
+/* libpurple's event loop, run by glib (as in a real UI) */
+
+typedef struct {
+	PurpleInputFunction function;
+	gpointer data;
+} GlibInput;
+
+static gboolean glib_input_cb(GIOChannel *source, GIOCondition condition, gpointer data) {
+	GlibInput *input = data;
+	PurpleInputCondition cond = 0;
+	if (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		cond |= PURPLE_INPUT_READ;
+	if (condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		cond |= PURPLE_INPUT_WRITE;
+	input->function(input->data, g_io_channel_unix_get_fd(source), cond);
+	return TRUE;
+}
+
+static guint glib_input_add(gint fd, PurpleInputCondition cond, PurpleInputFunction function, gpointer data) {
+	GlibInput *input = g_new(GlibInput, 1);
+	input->function = function;
+	input->data = data;
+
+	GIOCondition condition = 0;
+	if (cond & PURPLE_INPUT_READ)
+		condition |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+	if (cond & PURPLE_INPUT_WRITE)
+		condition |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+	GIOChannel *channel = g_io_channel_unix_new(fd);
+	guint id = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, condition, glib_input_cb, input, g_free);
+	g_io_channel_unref(channel);
+	return id;
+}
+
+static PurpleEventLoopUiOps glib_eventloop = {
+	g_timeout_add,
+	g_source_remove,
+	glib_input_add,
+	g_source_remove,
+	NULL,
+	g_timeout_add_seconds,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* ws_mask: every length and split into segments (as purple_websocket_sendv does), at every alignment */
+
+static void test_mask(void) {
+	guchar msg[80 + 3], out[80 + 3], expect[80];
+	unsigned i;
+	for (i = 0; i < sizeof(msg); i++)
+		msg[i] = g_random_int();
+
+	const uint32_t masks[] = { 0, 0xffffffff, 0x12345678, g_random_int() };
+	unsigned m, align;
+	size_t len, a, b;
+	for (m = 0; m < G_N_ELEMENTS(masks); m++)
+		for (align = 0; align < 4; align++)
+			for (len = 0; len <= 80; len++) {
+				const guchar *in = &msg[align];
+				for (i = 0; i < len; i++)
+					expect[i] = in[i] ^ ((const uint8_t *)&masks[m])[i & 3];
+
+				for (a = 0; a <= len; a++)
+					for (b = a; b <= len; b++) {
+						guchar *p = &out[3 - align];
+						ws_mask(p, in, a, ws_mask_at(masks[m], 0));
+						ws_mask(&p[a], &in[a], b - a, ws_mask_at(masks[m], a));
+						ws_mask(&p[b], &in[b], len - b, ws_mask_at(masks[m], b));
+						CHECK(!memcmp(p, expect, len), "ws_mask %08x len %zu split %zu,%zu align %u", masks[m], len, a, b, align);
+					}
+			}
+}
+
+/* Deflate round trips: messages are sent through a websocket to a local server that echoes each frame back (fragmented, if large) */
+
+struct echo {
+	GMainLoop *loop;
+	PurpleWebsocket *ws;
+	int fd; /* server side */
+	guint watch, output_watch;
+	GString *input, *output;
+	unsigned compressed; /* frames */
+
+	GString *msgs[10];
+	unsigned sent, received;
+};
+
+static gboolean echo_output_cb(GIOChannel *source, GIOCondition condition, gpointer data) {
+	struct echo *e = data;
+	ssize_t r = write(e->fd, e->output->str, e->output->len);
+	if (r < 0 && errno == EAGAIN)
+		return TRUE;
+	if (r > 0) {
+		g_string_erase(e->output, 0, r);
+		if (e->output->len)
+			return TRUE;
+	} else
+		CHECK(FALSE, "echo write: %s", g_strerror(errno));
+	e->output_watch = 0;
+	return FALSE;
+}
+
+/* written as the client is ready for it, as both ends are in this thread */
+static void echo_frame(struct echo *e, uint8_t header, const guchar *p, size_t len) {
+	guchar h[10];
+	size_t hlen = 2;
+	h[0] = header;
+	if (len > UINT16_MAX) {
+		h[1] = 127;
+		uint64_t l = GUINT64_TO_BE(len);
+		memcpy(&h[2], &l, 8);
+		hlen += 8;
+	} else if (len >= 126) {
+		h[1] = 126;
+		uint16_t l = GUINT16_TO_BE(len);
+		memcpy(&h[2], &l, 2);
+		hlen += 2;
+	} else
+		h[1] = len;
+	g_string_append_len(e->output, (gchar *)h, hlen);
+	g_string_append_len(e->output, (const gchar *)p, len);
+	if (!e->output_watch) {
+		GIOChannel *channel = g_io_channel_unix_new(e->fd);
+		e->output_watch = g_io_add_watch(channel, G_IO_OUT | G_IO_ERR, echo_output_cb, e);
+		g_io_channel_unref(channel);
+	}
+}
+
+static gboolean echo_server_cb(GIOChannel *source, GIOCondition condition, gpointer data) {
+	struct echo *e = data;
+	guchar buf[16384];
+	ssize_t r = read(e->fd, buf, sizeof(buf));
+	if (r < 0 && errno == EAGAIN)
+		return TRUE;
+	if (r <= 0) {
+		e->watch = 0;
+		return FALSE;
+	}
+	g_string_append_len(e->input, (gchar *)buf, r);
+
+	for (;;) {
+		guchar *p = (guchar *)e->input->str;
+		size_t avail = e->input->len, off = 2;
+		if (avail < off)
+			break;
+		CHECK(p[1] & WS_MASK, "client frame not masked");
+		uint64_t len = p[1] & ~WS_MASK;
+		if (len == 126) {
+			uint16_t l;
+			if (avail < off + 2)
+				break;
+			memcpy(&l, &p[off], 2);
+			len = GUINT16_FROM_BE(l);
+			off += 2;
+		} else if (len == 127) {
+			if (avail < off + 8)
+				break;
+			memcpy(&len, &p[off], 8);
+			len = GUINT64_FROM_BE(len);
+			off += 8;
+		}
+		if (avail < off + 4 + len)
+			break;
+		uint32_t mask;
+		memcpy(&mask, &p[off], 4);
+		off += 4;
+		guchar *payload = &p[off];
+		ws_mask(payload, payload, len, mask);
+
+		if (p[0] & WS_RSV1)
+			e->compressed++;
+		if (len > 1000) {
+			/* first fragment keeps the op and RSV1, the rest are continuations */
+			size_t third = len / 3;
+			echo_frame(e, p[0] & ~WS_FIN, payload, third);
+			echo_frame(e, WS_OP_CONT, &payload[third], third);
+			echo_frame(e, WS_FIN | WS_OP_CONT, &payload[2*third], len - 2*third);
+		} else
+			echo_frame(e, p[0], payload, len);
+
+		g_string_erase(e->input, 0, off + len);
+	}
+	return TRUE;
+}
+
+static void echo_send_next(struct echo *e) {
+	GString *m = e->msgs[e->sent++];
+	/* in up to three segments */
+	PurpleWebsocketVec vec[3];
+	size_t a = m->len / 3, b = m->len - m->len / 5;
+	vec[0].base = m->str;
+	vec[0].len = a;
+	vec[1].base = &m->str[a];
+	vec[1].len = b - a;
+	vec[2].base = &m->str[b];
+	vec[2].len = m->len - b;
+	purple_websocket_sendv(e->ws, PURPLE_WEBSOCKET_TEXT, vec, 3);
+}
+
+static void echo_client_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	struct echo *e = data;
+	if (op != PURPLE_WEBSOCKET_TEXT) {
+		CHECK(FALSE, "websocket op %x: %.*s", op, (int)len, msg);
+		g_main_loop_quit(e->loop);
+		return;
+	}
+
+	GString *m = e->msgs[e->received++];
+	CHECK(len == m->len && !memcmp(msg, m->str, len), "echo of message %u (%zu bytes) came back as %zu bytes", e->received-1, m->len, len);
+	if (e->received < G_N_ELEMENTS(e->msgs))
+		echo_send_next(e);
+	else
+		g_main_loop_quit(e->loop);
+}
+
+static gboolean echo_timeout(gpointer data) {
+	struct echo *e = data;
+	CHECK(FALSE, "echo timed out after %u of %u messages", e->received, e->sent);
+	g_main_loop_quit(e->loop);
+	return FALSE;
+}
+
+static void test_echo(const char *extensions) {
+	/* every other message is incompressible */
+	static const size_t sizes[] = { 0, 1, DEFLATE_MIN-1, DEFLATE_MIN, 125, 126, 4096, UINT16_MAX+1, 300000, UINT16_MAX };
+	struct echo e = { 0 };
+	G_STATIC_ASSERT(G_N_ELEMENTS(sizes) == G_N_ELEMENTS(e.msgs));
+	unsigned i, deflatable = 0;
+	size_t j;
+	for (i = 0; i < G_N_ELEMENTS(e.msgs); i++) {
+		e.msgs[i] = g_string_sized_new(sizes[i]);
+		for (j = 0; j < sizes[i]; j++)
+			g_string_append_c(e.msgs[i], i & 1 ? (gchar)g_random_int() : "abcdefgh"[(j + j / 1000) % 8]);
+		if (sizes[i] >= DEFLATE_MIN)
+			deflatable++;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		CHECK(FALSE, "socketpair: %s", g_strerror(errno));
+		return;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	PurpleWebsocket *ws = e.ws = g_new0(PurpleWebsocket, 1);
+	ws->callback = echo_client_cb;
+	ws->user_data = &e;
+	ws->fd = sv[0];
+	ws->input_max = INPUT_MAX_DEFAULT;
+	buffer_set_len(&ws->input, INPUT_MIN);
+	buffer_need(&ws->input, 2);
+	if (extensions)
+		CHECK(ws_read_extensions(ws, extensions), "rejected extensions: %s", extensions);
+	ws->connected = TRUE;
+	ws_input(ws);
+
+	e.fd = sv[1];
+	e.input = g_string_new(NULL);
+	e.output = g_string_new(NULL);
+	GIOChannel *channel = g_io_channel_unix_new(e.fd);
+	e.watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, echo_server_cb, &e);
+	g_io_channel_unref(channel);
+
+	e.loop = g_main_loop_new(NULL, FALSE);
+	guint timer = g_timeout_add_seconds(10, echo_timeout, &e);
+	echo_send_next(&e);
+	g_main_loop_run(e.loop);
+	g_source_remove(timer);
+
+	CHECK(e.received == G_N_ELEMENTS(e.msgs), "%s: %u of %u messages echoed", extensions ?: "no extensions", e.received, (unsigned)G_N_ELEMENTS(e.msgs));
+	if (extensions)
+		CHECK(e.compressed == deflatable, "%s: %u of %u messages compressed", extensions, e.compressed, deflatable);
+	else
+		CHECK(!e.compressed, "compressed without negotiating");
+
+	purple_websocket_abort(ws);
+	if (e.watch)
+		g_source_remove(e.watch);
+	if (e.output_watch)
+		g_source_remove(e.output_watch);
+	close(e.fd);
+	g_main_loop_unref(e.loop);
+	g_string_free(e.input, TRUE);
+	g_string_free(e.output, TRUE);
+	for (i = 0; i < G_N_ELEMENTS(e.msgs); i++)
+		g_string_free(e.msgs[i], TRUE);
+}
+
+/* slack_message_to_html: expected output captured from the renderer it replaced (which copied and modified the text in place) */
+
+static const struct {
+	const char *text, *prepend, *html;
+	gboolean nick;
+} html_cases[] = {
+	{ "", NULL, "", FALSE },
+	{ "hello", NULL, "hello", FALSE },
+	{ "a\nb\n", NULL, "a<BR>b<BR>", FALSE },
+	{ "a\nb\n", "&gt; ", "a<BR>&gt; b<BR>&gt; ", FALSE },
+	{ "<@U123> hi <@U0SELF>", NULL, "@bob hi @me", TRUE },
+	{ "<@U999|x> <#C42> <#C42|gen> <#C9>", NULL, "@x #general #gen #C9", FALSE },
+	{ "<!here> <!channel|@channel> <!subteam^S1|@team> <!date^1|x>", NULL, "@here @@channel &lt;@team&gt; &lt;x&gt;", TRUE },
+	{ "see <http://x.com/a?b=1&amp;c|link> and <mailto:a@b>", NULL, "see <A HREF=\"http://x.com/a?b=1&amp;c\">link</A> and <A HREF=\"mailto:a@b\">mailto:a@b</A>", FALSE },
+	{ "unterminated <http://x", NULL, "unterminated <A HREF=\"http://x\">http://x</A>", FALSE },
+	{ "<", NULL, "<A HREF=\"\"></A>", FALSE },
+	{ "<>", NULL, "<A HREF=\"\"></A>", FALSE },
+	{ "x <|> y", NULL, "x <A HREF=\"\"></A> y", FALSE },
+	{ "&lt;b&gt; & \n<@U123|bob>\n", NULL, "&lt;b&gt; & <BR>@bob<BR>", FALSE },
+	{ "&lt;b&gt; & \n<@U123|bob>\n", "&gt; ", "&lt;b&gt; & <BR>&gt; @bob<BR>&gt; ", FALSE },
+	{ "<@>", NULL, "@", FALSE },
+	{ "<@U0SELFX>", NULL, "@U0SELFX", FALSE },
+	{ "<#C42|>", NULL, "#", FALSE },
+};
+
+static SlackObject *html_object(GType type, GHashTable *table, const char *id, const char *name) {
+	SlackObject *obj = g_object_new(type, NULL);
+	slack_object_id_set(obj->id, id);
+	slack_intern_set(&obj->name, name);
+	g_hash_table_insert(table, obj->id, obj);
+	return obj;
+}
+
+static void test_html(void) {
+	SlackAccount sa = { 0 };
+	sa.users = slack_object_hash_table_new();
+	sa.channels = slack_object_hash_table_new();
+	sa.self = (SlackUser *)g_object_ref(html_object(SLACK_TYPE_USER, sa.users, "U0SELF", "me"));
+	html_object(SLACK_TYPE_USER, sa.users, "U123", "bob");
+	html_object(SLACK_TYPE_CHANNEL, sa.channels, "C42", "general");
+
+	unsigned i;
+	for (i = 0; i < G_N_ELEMENTS(html_cases); i++) {
+		GString *html = g_string_new(NULL);
+		PurpleMessageFlags flags = 0;
+		slack_message_to_html(html, &sa, html_cases[i].text, &flags, html_cases[i].prepend);
+		CHECK(!strcmp(html->str, html_cases[i].html), "html of \"%s\": \"%s\", expected \"%s\"", html_cases[i].text, html->str, html_cases[i].html);
+		CHECK(flags & PURPLE_MESSAGE_NO_LINKIFY, "html of \"%s\": not NO_LINKIFY", html_cases[i].text);
+		CHECK(!(flags & PURPLE_MESSAGE_NICK) == !html_cases[i].nick, "html of \"%s\": NICK flag %s", html_cases[i].text, flags & PURPLE_MESSAGE_NICK ? "set" : "unset");
+		g_string_free(html, TRUE);
+	}
+
+	g_object_unref(sa.self);
+	g_hash_table_destroy(sa.users);
+	g_hash_table_destroy(sa.channels);
+}
+
+int main(void) {
+	purple_eventloop_set_ui_ops(&glib_eventloop);
+
+	test_mask();
+	test_echo(NULL);
+	test_echo("permessage-deflate");
+	test_echo("permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+	test_html();
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}